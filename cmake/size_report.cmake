@@ -0,0 +1,46 @@
+# SPDX-License-Identifier: MIT
+#
+# Prints the flash and RAM contribution of the threshold temp layer library and fails when
+# a budget is exceeded. Run with cmake -P and:
+#   SIZE_TOOL     size binary of the target toolchain
+#   LIBRARY       path of the module library archive
+#   FEATURES      comma separated list of enabled features, for the report only
+#   FLASH_BUDGET  maximum text + data in bytes, 0 for no limit
+#   RAM_BUDGET    maximum data + bss in bytes, 0 for no limit
+
+execute_process(
+  COMMAND ${SIZE_TOOL} -t ${LIBRARY}
+  OUTPUT_VARIABLE output
+  ERROR_VARIABLE error
+  RESULT_VARIABLE result
+)
+
+if(NOT result EQUAL 0)
+  message(FATAL_ERROR "${SIZE_TOOL} failed on ${LIBRARY}: ${error}")
+endif()
+
+string(REGEX MATCH "([0-9]+)[ \t]+([0-9]+)[ \t]+([0-9]+)[ \t]+[0-9]+[ \t]+[0-9a-fA-F]+[ \t]+\\(TOTALS\\)"
+  totals "${output}")
+
+if(NOT totals)
+  message(FATAL_ERROR "No totals in ${SIZE_TOOL} output:\n${output}")
+endif()
+
+set(text ${CMAKE_MATCH_1})
+set(data ${CMAKE_MATCH_2})
+set(bss ${CMAKE_MATCH_3})
+math(EXPR flash "${text} + ${data}")
+math(EXPR ram "${data} + ${bss}")
+
+message("${output}")
+message("threshold temp layer features: ${FEATURES}")
+message("threshold temp layer flash: ${flash} bytes (.text ${text} + .data ${data})")
+message("threshold temp layer RAM: ${ram} bytes (.data ${data} + .bss ${bss})")
+
+if(FLASH_BUDGET GREATER 0 AND flash GREATER FLASH_BUDGET)
+  message(FATAL_ERROR "threshold temp layer flash ${flash} bytes exceeds the budget of ${FLASH_BUDGET}")
+endif()
+
+if(RAM_BUDGET GREATER 0 AND ram GREATER RAM_BUDGET)
+  message(FATAL_ERROR "threshold temp layer RAM ${ram} bytes exceeds the budget of ${RAM_BUDGET}")
+endif()
@@ -0,0 +1,19 @@
+/*
+ * Copyright (c) 2024 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#define TTL_THRESHOLD_INC_CMD 0
+#define TTL_THRESHOLD_DEC_CMD 1
+#define TTL_IDLE_INC_CMD 2
+#define TTL_IDLE_DEC_CMD 3
+#define TTL_RESET_CMD 4
+
+#define TTL_THRESHOLD_INC TTL_THRESHOLD_INC_CMD
+#define TTL_THRESHOLD_DEC TTL_THRESHOLD_DEC_CMD
+#define TTL_IDLE_INC TTL_IDLE_INC_CMD
+#define TTL_IDLE_DEC TTL_IDLE_DEC_CMD
+#define TTL_RESET TTL_RESET_CMD
@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2024 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <zephyr/device.h>
+#include <zephyr/input/input.h>
+#include <drivers/input_processor.h>
+
+/**
+ * Process all input events of one sensor read in a single call.
+ *
+ * The events (typically REL_X, REL_Y and the one carrying the sync flag) are accumulated
+ * together and evaluated as one frame, with a single state lookup, threshold check and
+ * timeout refresh. The events are not modified. The per-event input processor API behaves
+ * like calling this with a count of 1.
+ *
+ * @param dev Threshold temp layer processor device.
+ * @param events Contiguous events of one sensor read.
+ * @param count Number of events.
+ * @param layer Keymap layer to activate, the first processor parameter.
+ * @param timeout Deactivation timeout in ms, the second processor parameter.
+ * @param state Processor state of the calling listener, may be NULL.
+ *
+ * @return 0, events are always passed on.
+ */
+int zmk_input_processor_threshold_temp_layer_handle_events(
+    const struct device *dev, const struct input_event *events, size_t count, uint32_t layer,
+    uint32_t timeout, struct zmk_input_processor_state *state);
+
+/**
+ * Like zmk_input_processor_threshold_temp_layer_handle_events(), with the time the sensor
+ * sampled the motion instead of the time of processing.
+ *
+ * Timeout, decay, velocity and the idle gate then follow the real motion timing even if the
+ * events were delayed by a busy work queue or a split link.
+ *
+ * @param timestamp Sample time in milliseconds, taken with
+ *                  zmk_input_processor_threshold_temp_layer_timestamp().
+ *
+ * @return 0, events are always passed on.
+ */
+int zmk_input_processor_threshold_temp_layer_handle_events_at(
+    const struct device *dev, const struct input_event *events, size_t count, uint32_t timestamp,
+    uint32_t layer, uint32_t timeout, struct zmk_input_processor_state *state);
+
+/**
+ * Current time of the clock the processor uses, in milliseconds.
+ *
+ * This is the 32 bit uptime, or the cycle counter based clock with
+ * CONFIG_ZMK_INPUT_PROCESSOR_THRESHOLD_TEMP_LAYER_CYCLE_CLOCK. Drivers can call it when they
+ * sample the sensor, including from interrupt context.
+ */
+uint32_t zmk_input_processor_threshold_temp_layer_timestamp(void);
+/**
+ * Shift the activation threshold and the required prior idle time of every layer handled by
+ * a threshold temp layer processor.
+ *
+ * The new values take effect with the next motion frame. Results are clamped at 0. With
+ * CONFIG_ZMK_INPUT_PROCESSOR_THRESHOLD_TEMP_LAYER_SETTINGS they are saved to flash after
+ * CONFIG_ZMK_SETTINGS_SAVE_DEBOUNCE milliseconds without further changes.
+ *
+ * @param dev Threshold temp layer processor device.
+ * @param threshold_delta Change of activation-threshold, in counts, or micrometres if the
+ *                        processor has a cpi property.
+ * @param idle_delta Change of require-prior-idle-ms, in milliseconds.
+ *
+ * @return 0 on success.
+ */
+int zmk_input_processor_threshold_temp_layer_adjust(const struct device *dev,
+                                                    int32_t threshold_delta, int32_t idle_delta);
+
+/**
+ * Restore the devicetree values of all runtime adjustable settings of a processor.
+ *
+ * @param dev Threshold temp layer processor device.
+ *
+ * @return 0 on success.
+ */
+int zmk_input_processor_threshold_temp_layer_reset_tuning(const struct device *dev);
+
+/**
+ * Rescale the thresholds of a processor after the sensor resolution changed at runtime.
+ *
+ * Only applies to processors with a cpi property, whose thresholds are given in micrometres.
+ * The conversion to counts is done here, so the input path keeps comparing plain counts.
+ *
+ * @param dev Threshold temp layer processor device.
+ * @param cpi New sensor resolution in counts per inch.
+ *
+ * @return 0 on success, -ENOTSUP if the processor has no cpi property, -EINVAL if cpi is 0.
+ */
+int zmk_input_processor_threshold_temp_layer_set_cpi(const struct device *dev, uint16_t cpi);
+
+#if defined(CONFIG_ZTEST)
+
+/**
+ * Whether the shared timeout work of a processor is scheduled, queued or running. Only built
+ * for tests, which use it to check that an idle instance keeps no timer pending.
+ *
+ * @param dev Threshold temp layer processor device.
+ */
+bool zmk_input_processor_threshold_temp_layer_timer_pending(const struct device *dev);
+
+#endif
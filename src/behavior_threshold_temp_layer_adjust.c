@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2024 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#define DT_DRV_COMPAT zmk_behavior_threshold_temp_layer_adjust
+
+#include <zephyr/device.h>
+#include <zephyr/logging/log.h>
+
+#include <drivers/behavior.h>
+#include <dt-bindings/zmk/threshold_temp_layer.h>
+
+#include <zmk/behavior.h>
+#include <zmk/input_processor_threshold_temp_layer.h>
+
+LOG_MODULE_DECLARE(zmk, CONFIG_ZMK_LOG_LEVEL);
+
+#if DT_HAS_COMPAT_STATUS_OKAY(DT_DRV_COMPAT)
+
+struct behavior_threshold_temp_layer_adjust_config {
+    const struct device *processor;
+    int32_t threshold_step;
+    int32_t idle_step;
+};
+
+static int on_keymap_binding_pressed(struct zmk_behavior_binding *binding,
+                                     struct zmk_behavior_binding_event event) {
+    const struct device *dev = zmk_behavior_get_binding(binding->behavior_dev);
+    const struct behavior_threshold_temp_layer_adjust_config *cfg = dev->config;
+
+    switch (binding->param1) {
+    case TTL_THRESHOLD_INC_CMD:
+        zmk_input_processor_threshold_temp_layer_adjust(cfg->processor, cfg->threshold_step, 0);
+        break;
+    case TTL_THRESHOLD_DEC_CMD:
+        zmk_input_processor_threshold_temp_layer_adjust(cfg->processor, -cfg->threshold_step, 0);
+        break;
+    case TTL_IDLE_INC_CMD:
+        zmk_input_processor_threshold_temp_layer_adjust(cfg->processor, 0, cfg->idle_step);
+        break;
+    case TTL_IDLE_DEC_CMD:
+        zmk_input_processor_threshold_temp_layer_adjust(cfg->processor, 0, -cfg->idle_step);
+        break;
+    case TTL_RESET_CMD:
+        zmk_input_processor_threshold_temp_layer_reset_tuning(cfg->processor);
+        break;
+    default:
+        LOG_ERR("Unknown threshold temp layer command: %d", binding->param1);
+        return -ENOTSUP;
+    }
+
+    return ZMK_BEHAVIOR_OPAQUE;
+}
+
+static int on_keymap_binding_released(struct zmk_behavior_binding *binding,
+                                      struct zmk_behavior_binding_event event) {
+    return ZMK_BEHAVIOR_OPAQUE;
+}
+
+static const struct behavior_driver_api behavior_threshold_temp_layer_adjust_driver_api = {
+    .binding_pressed = on_keymap_binding_pressed,
+    .binding_released = on_keymap_binding_released,
+};
+
+#define THRESHOLD_TEMP_LAYER_ADJUST_INST(n)                                                \
+    static const struct behavior_threshold_temp_layer_adjust_config                        \
+        behavior_threshold_temp_layer_adjust_config_##n = {                                \
+            .processor = DEVICE_DT_GET(DT_INST_PHANDLE(n, input_processor)),               \
+            .threshold_step = DT_INST_PROP(n, threshold_step),                             \
+            .idle_step = DT_INST_PROP(n, idle_step),                                       \
+    };                                                                                     \
+    BEHAVIOR_DT_INST_DEFINE(n, NULL, NULL, NULL,                                           \
+                            &behavior_threshold_temp_layer_adjust_config_##n, POST_KERNEL, \
+                            CONFIG_KERNEL_INIT_PRIORITY_DEFAULT,                           \
+                            &behavior_threshold_temp_layer_adjust_driver_api);
+
+DT_INST_FOREACH_STATUS_OKAY(THRESHOLD_TEMP_LAYER_ADJUST_INST)
+
+#endif
@@ -6,10 +6,26 @@
 
 #define DT_DRV_COMPAT zmk_input_processor_threshold_temp_layer
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <zephyr/device.h>
+#include <zephyr/init.h>
 #include <zephyr/kernel.h>
 #include <zephyr/logging/log.h>
+#include <zephyr/sys/atomic.h>
+
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+#endif
+
+#if defined(CONFIG_ZMK_INPUT_PROCESSOR_THRESHOLD_TEMP_LAYER_SETTINGS)
+#include <zephyr/settings/settings.h>
+#endif
+
+#if defined(CONFIG_ZMK_INPUT_PROCESSOR_THRESHOLD_TEMP_LAYER_STATS)
+#include <zephyr/timing/timing.h>
+#endif
 
 #include <zephyr/dt-bindings/input/input-event-codes.h>
 
@@ -17,165 +33,1357 @@
 #include <zmk/event_manager.h>
 #include <drivers/input_processor.h>
 #include <zmk/events/position_state_changed.h>
+#include <zmk/input_processor_threshold_temp_layer.h>
+
+#if defined(CONFIG_ZMK_INPUT_PROCESSOR_THRESHOLD_TEMP_LAYER_TRACE)
+#include "input_processor_threshold_temp_layer_trace.h"
+
+#define TRACE_FRAME(...) threshold_temp_layer_trace_frame(__VA_ARGS__)
+#else
+#define TRACE_FRAME(...)
+#endif
 
 LOG_MODULE_DECLARE(zmk, CONFIG_ZMK_LOG_LEVEL);
 
 #define MAX_LAYERS 16
 
-struct threshold_temp_layer_config {
-    int16_t require_prior_idle_ms;
-    int32_t activation_threshold;
-    const uint8_t *excluded_positions;
-    size_t excluded_positions_len;
+#define UM_PER_INCH 25400
+
+// Size of the per-layer ring of recent frame distances used by predict-frames
+#define PREDICT_MAX_FRAMES 4
+
+#define MAX_TIERS 4
+
+// shown_layer of a slot that is not active
+#define SHOWN_LAYER_NONE UINT8_MAX
+// Set in shown_layer while the deactivating path turns the layer off, layers stay below it
+#define SHOWN_LAYER_RETIRING BIT(7)
+
+// Key positions in devicetree are uint8_t, so 256 bit bitmaps cover all of them
+#define POSITION_BITMAP_WORDS 8
+
+enum threshold_temp_layer_activation_mode {
+    ACTIVATION_MODE_DISTANCE,
+    ACTIVATION_MODE_VELOCITY,
+};
+
+enum threshold_temp_layer_deactivate_policy {
+    DEACTIVATE_POLICY_ANY,
+    DEACTIVATE_POLICY_UNBOUND_KEYS,
+    DEACTIVATE_POLICY_RELEASE,
+};
+
+enum threshold_temp_layer_distance_metric {
+    DISTANCE_METRIC_OCTAGON,
+    DISTANCE_METRIC_ALPHA_MAX_BETA_MIN,
+    DISTANCE_METRIC_EUCLIDEAN,
 };
 
+// Concurrency model: the accumulators, velocity, rearm and generation_seen fields belong to the
+// input path. The timeout work and the key press listener never write them; after winning the
+// active bit of a slot they bump its generation instead, and the input path resets its own state
+// when it sees the change. The remaining shared fields are single words written before the
+// atomic operation that publishes them.
 struct threshold_temp_layer_layer_data {
+    uint8_t layer;
+    // Number of tiers upgraded to since the activation
+    uint8_t tier;
+    // Set after a timeout deactivation, the reduced rearm threshold applies until the window ends
+    bool rearm;
+    // 0 if the layer only deactivates on key press
+    uint16_t timeout_ms;
     int32_t accumulated_distance;
-    bool active;
-    struct k_work_delayable disable_work;
+    // Exponential moving average of counts per millisecond, Q16 fixed point
+    int32_t velocity;
+    // Keymap layer the slot currently shows: its own layer, the layer of a tier, or
+    // SHOWN_LAYER_NONE. Claimed with atomic_cas on activation and frozen with
+    // SHOWN_LAYER_RETIRING by the path that deactivates the slot until the layer is off, so
+    // neither a tier upgrade nor a new activation can slip in between.
+    atomic_t shown_layer;
+    // Uptime of the last frame evaluated while inactive, for velocity and decay
+    uint32_t last_frame;
+    uint32_t deactivated_at;
+    // Deactivation count << 1 | rearm flag of the last deactivation, see retire_slot()
+    atomic_t generation;
+    uint32_t generation_seen;
+    // Uptime of the most recent motion; the timeout work re-arms itself from this
+    atomic_t last_motion;
+    // Runtime copies of the layer config, changed by the adjust API and persisted in settings.
+    // The threshold is kept in the configured unit, and pre-scaled to counts for the input path.
+    int32_t threshold_setting;
+    atomic_t activation_threshold;
+    atomic_t require_prior_idle_ms;
+};
+
+// Per-slot state of predict-frames, only allocated for instances that set it
+struct threshold_temp_layer_predict_data {
+    // Distances of the most recent frames and their sum
+    uint16_t ring[PREDICT_MAX_FRAMES];
+    uint8_t count;
+    uint8_t head;
+    int32_t sum;
+    // 1 while the layer is active on a prediction that the real threshold has not confirmed
+    // yet. Cleared with atomic_cas by whichever of confirmation and revert comes first.
+    atomic_t speculative;
+    uint32_t activated_at;
+};
+
+// Settings that can be overridden for a single layer with a child node. These are the
+// defaults of the runtime copies in the layer data.
+struct threshold_temp_layer_layer_config {
+    int32_t activation_threshold;
+    int16_t require_prior_idle_ms;
+};
+
+struct threshold_temp_layer_config {
+    enum threshold_temp_layer_activation_mode activation_mode;
+    enum threshold_temp_layer_distance_metric distance_metric;
+    enum threshold_temp_layer_deactivate_policy deactivate_policy;
+    // Counts per millisecond, Q16 fixed point
+    int32_t velocity_threshold;
+    uint8_t velocity_smoothing;
+    uint16_t decay_window_ms;
+    uint16_t decay_per_ms;
+    uint16_t rearm_window_ms;
+    int32_t rearm_threshold;
+    uint8_t predict_frames;
+    uint16_t predict_confirm_ms;
+    // Threshold and layer pairs, sorted by threshold
+    const int32_t *tiers;
+    uint8_t num_tiers;
+    // Sensor resolution; if set, thresholds are in micrometres instead of counts
+    uint16_t cpi;
+    uint8_t wheel_weight;
+    // Pre-filter of the frame motion
+    uint8_t dead_zone_x;
+    uint8_t dead_zone_y;
+    uint8_t x_weight;
+    uint8_t y_weight;
+    bool sign_filter;
+    bool frame_accumulation;
+    uint32_t excluded_positions[POSITION_BITMAP_WORDS];
+    // Keymap layer -> slot index + 1, or 0 if the layer has no slot on this instance
+    uint8_t layer_slots[MAX_LAYERS];
+    uint8_t num_slots;
+    // Both indexed by slot
+    const struct threshold_temp_layer_layer_config *layer_configs;
+    struct threshold_temp_layer_layer_data *layers;
+    // Indexed by slot like layers, NULL if predict-frames is 0
+    struct threshold_temp_layer_predict_data *predict;
+};
+
+#if defined(CONFIG_ZMK_INPUT_PROCESSOR_THRESHOLD_TEMP_LAYER_STATS)
+
+// Bucket i counts handler calls that took [2^(i-1), 2^i) cycles, the last bucket is open ended
+#define STATS_CYCLE_BUCKETS 16
+
+struct threshold_temp_layer_stats {
+    atomic_t events;
+    atomic_t frames;
+    atomic_t activations;
+    atomic_t timeout_deactivations;
+    atomic_t keypress_deactivations;
+    atomic_t prediction_reverts;
+    atomic_t tier_upgrades;
+    // Handler calls over CONFIG_ZMK_INPUT_PROCESSOR_THRESHOLD_TEMP_LAYER_CYCLE_BUDGET
+    atomic_t budget_overruns;
+    atomic_t idle_rejections;
+    atomic_t cycles[STATS_CYCLE_BUCKETS];
+};
+
+#define STATS_INC(data, counter) atomic_inc(&(data)->stats.counter)
+
+#else
+
+#define STATS_INC(data, counter)
+
+#endif
+
+#define MAX_LISTENERS CONFIG_ZMK_INPUT_PROCESSOR_THRESHOLD_TEMP_LAYER_MAX_LISTENERS
+
+// Motion buffered until the end of the current report, one per input listener
+struct threshold_temp_layer_frame {
+    int32_t dx;
+    int32_t dy;
+    // Sum of absolute REL_WHEEL and REL_HWHEEL values
+    int32_t wheel;
+    // Sign of the last motion that passed the dead zone on each axis, for sign-filter
+    int8_t sign_x;
+    int8_t sign_y;
 };
 
 struct threshold_temp_layer_data {
-    int64_t last_tap_time;
-    struct threshold_temp_layer_layer_data layers[MAX_LAYERS];
+    const struct device *dev;
+    // Shared by all layer slots and armed for the earliest deadline. It is never pending
+    // while no layer is active, so an idle instance keeps no timer in the timeout queue.
+    struct k_work_delayable timeout_work;
+    // 32 bit uptime in ms of the last key press, a single word so it never tears
+    atomic_t last_tap_time;
+    struct threshold_temp_layer_frame frames[MAX_LISTENERS];
+    // Bit i is set while layers[i] of the config is active. Whoever flips a bit with an atomic
+    // operation owns the matching keymap transition, so racing paths never double activate or
+    // deactivate a layer.
+    atomic_t active_layers;
+    // Current sensor resolution, and rearm-threshold scaled to counts with it
+    uint16_t cpi;
+    atomic_t rearm_threshold;
+    // Tier thresholds scaled to counts, followed by INT32_MAX as end marker
+    atomic_t tier_thresholds[MAX_TIERS + 1];
+#if defined(CONFIG_ZMK_INPUT_PROCESSOR_THRESHOLD_TEMP_LAYER_STATS)
+    struct threshold_temp_layer_stats stats;
+#endif
+#if defined(CONFIG_ZMK_INPUT_PROCESSOR_THRESHOLD_TEMP_LAYER_SETTINGS)
+    // Debounces flash writes after runtime adjustments
+    struct k_work_delayable save_work;
+#endif
 };
 
-static int calculate_distance(int dx, int dy) {
+#if defined(CONFIG_ZMK_INPUT_PROCESSOR_THRESHOLD_TEMP_LAYER_DEFERRED_LAYER_UPDATES)
+
+// Requested state of each keymap layer, written from any context
+static atomic_t layer_requested;
+// State last passed to the keymap, only touched by the layer update work
+static uint32_t layer_applied;
+
+static K_THREAD_STACK_DEFINE(
+    layer_update_stack, CONFIG_ZMK_INPUT_PROCESSOR_THRESHOLD_TEMP_LAYER_LAYER_UPDATE_STACK_SIZE);
+static struct k_work_q layer_update_q;
+
+// Applies the net change since the last run, so bursts of transitions on a layer collapse into
+// at most one keymap call and one layer-state-changed event. Activations go first, so a tier
+// upgrade never drops the keymap to a lower layer between turning off the old layer and
+// turning on the new one.
+static void layer_update_work_handler(struct k_work *work) {
+    uint32_t requested = atomic_get(&layer_requested);
+    uint32_t changed = requested ^ layer_applied;
+    uint32_t activated = changed & requested;
+    uint32_t deactivated = changed & ~requested;
+
+    layer_applied = requested;
+
+    while (activated) {
+        zmk_keymap_layer_activate(__builtin_ctz(activated));
+        activated &= activated - 1;
+    }
+
+    while (deactivated) {
+        zmk_keymap_layer_deactivate(__builtin_ctz(deactivated));
+        deactivated &= deactivated - 1;
+    }
+}
+
+static K_WORK_DEFINE(layer_update_work, layer_update_work_handler);
+
+static void set_keymap_layer(uint8_t layer, bool active) {
+    if (active) {
+        atomic_or(&layer_requested, BIT(layer));
+    } else {
+        atomic_and(&layer_requested, ~BIT(layer));
+    }
+
+    k_work_submit_to_queue(&layer_update_q, &layer_update_work);
+}
+
+static int layer_update_init(void) {
+    k_work_queue_start(&layer_update_q, layer_update_stack,
+                       K_THREAD_STACK_SIZEOF(layer_update_stack),
+                       CONFIG_ZMK_INPUT_PROCESSOR_THRESHOLD_TEMP_LAYER_LAYER_UPDATE_PRIORITY, NULL);
+    return 0;
+}
+
+SYS_INIT(layer_update_init, POST_KERNEL, CONFIG_KERNEL_INIT_PRIORITY_DEFAULT);
+
+#else
+
+static void set_keymap_layer(uint8_t layer, bool active) {
+    if (active) {
+        zmk_keymap_layer_activate(layer);
+    } else {
+        zmk_keymap_layer_deactivate(layer);
+    }
+}
+
+#endif
+
+// Integer square root by binary digits, only shifts, adds and compares
+static uint32_t isqrt32(uint32_t value) {
+    uint32_t root = 0;
+    uint32_t bit = 1UL << 30;
+
+    while (bit > value) {
+        bit >>= 2;
+    }
+
+    while (bit) {
+        if (value >= root + bit) {
+            value -= root + bit;
+            root = (root >> 1) + bit;
+        } else {
+            root >>= 1;
+        }
+        bit >>= 2;
+    }
+
+    return root;
+}
+
+static int calculate_distance(enum threshold_temp_layer_distance_metric metric, int dx, int dy) {
     int abs_dx = abs(dx);
     int abs_dy = abs(dy);
+
+    if (metric == DISTANCE_METRIC_EUCLIDEAN) {
+        // Clamped so both squares and their sum fit in 32 bits, no 64 bit multiply needed
+        uint32_t x = MIN(abs_dx, INT16_MAX);
+        uint32_t y = MIN(abs_dy, INT16_MAX);
+
+        return isqrt32(x * x + y * y);
+    }
+
     int max_val = (abs_dx > abs_dy) ? abs_dx : abs_dy;
     int min_val = (abs_dx > abs_dy) ? abs_dy : abs_dx;
-    return max_val + (min_val >> 1);
+
+    if (metric == DISTANCE_METRIC_OCTAGON) {
+        return max_val + (min_val >> 1);
+    }
+
+    // 15/16 * max + 15/32 * min, within about 6% of sqrt(dx^2 + dy^2)
+    return max_val - (max_val >> 4) + (min_val >> 1) - (min_val >> 5);
 }
 
-struct layer_disable_work_data {
-    const struct device *dev;
-    uint8_t layer;
+// Convert a threshold from the configured unit to sensor counts, rounding to nearest
+static int32_t threshold_counts(uint16_t cpi, int32_t value) {
+    if (cpi == 0) {
+        return value;
+    }
+
+    return (int32_t)(((int64_t)value * cpi + UM_PER_INCH / 2) / UM_PER_INCH);
+}
+
+static void set_threshold(struct threshold_temp_layer_data *data,
+                          struct threshold_temp_layer_layer_data *layer_data, int32_t value) {
+    layer_data->threshold_setting = value;
+    atomic_set(&layer_data->activation_threshold, threshold_counts(data->cpi, value));
+}
+
+static void reset_accumulation(struct threshold_temp_layer_layer_data *layer_data,
+                               struct threshold_temp_layer_predict_data *predict) {
+    layer_data->accumulated_distance = 0;
+    layer_data->velocity = 0;
+    layer_data->tier = 0;
+
+    if (predict) {
+        predict->count = 0;
+        predict->head = 0;
+        predict->sum = 0;
+    }
+}
+
+static void set_tier_thresholds(struct threshold_temp_layer_data *data,
+                                const struct threshold_temp_layer_config *cfg) {
+    for (int i = 0; i < cfg->num_tiers; i++) {
+        atomic_set(&data->tier_thresholds[i], threshold_counts(data->cpi, cfg->tiers[2 * i]));
+    }
+
+    atomic_set(&data->tier_thresholds[cfg->num_tiers], INT32_MAX);
+}
+
+// Record the distance of a frame that did not reach the threshold, and check whether the mean
+// of the last predict_frames frames would carry the accumulated distance across it next frame
+static bool predict_crossing(const struct threshold_temp_layer_config *cfg,
+                             struct threshold_temp_layer_layer_data *layer_data,
+                             struct threshold_temp_layer_predict_data *predict, int distance,
+                             int32_t threshold) {
+    uint16_t clamped = MIN(distance, UINT16_MAX);
+
+    if (predict->count == cfg->predict_frames) {
+        predict->sum -= predict->ring[predict->head];
+    } else {
+        predict->count++;
+    }
+
+    predict->ring[predict->head] = clamped;
+    predict->sum += clamped;
+    predict->head = (predict->head + 1) % cfg->predict_frames;
+
+    if (predict->count < cfg->predict_frames) {
+        return false;
+    }
+
+    return layer_data->accumulated_distance + predict->sum / cfg->predict_frames >= threshold;
+}
+
+static int32_t update_velocity(const struct threshold_temp_layer_config *cfg,
+                               struct threshold_temp_layer_layer_data *layer_data, int distance,
+                               uint32_t now) {
+    uint32_t dt = now - layer_data->last_frame;
+
+    layer_data->last_frame = now;
+
+    // Reports inside the same uptime millisecond are treated as 1 ms apart
+    if (dt == 0) {
+        dt = 1;
+    }
+
+    // Clamping keeps the Q16 sample and the EMA difference inside int32_t
+    int32_t sample = (int32_t)(((uint32_t)MIN(distance, INT16_MAX) << 16) / dt);
+
+    layer_data->velocity += (sample - layer_data->velocity) >> cfg->velocity_smoothing;
+
+    return layer_data->velocity;
+}
+
+// Leak the accumulated distance for the idle time since the previous frame, computed lazily
+// here instead of from a periodic timer
+static void decay_distance(const struct threshold_temp_layer_config *cfg,
+                           struct threshold_temp_layer_layer_data *layer_data, uint32_t now) {
+    uint32_t idle = now - layer_data->last_frame;
+
+    layer_data->last_frame = now;
+
+    if (idle <= cfg->decay_window_ms || layer_data->accumulated_distance == 0) {
+        return;
+    }
+
+    uint64_t leak = (uint64_t)(idle - cfg->decay_window_ms) * cfg->decay_per_ms;
+
+    if (leak >= (uint64_t)layer_data->accumulated_distance) {
+        layer_data->accumulated_distance = 0;
+    } else {
+        layer_data->accumulated_distance -= leak;
+    }
+}
+
+#if defined(CONFIG_ZMK_INPUT_PROCESSOR_THRESHOLD_TEMP_LAYER_CYCLE_CLOCK)
+
+static struct k_spinlock cycle_clock_lock;
+// Cycle count of the last read, and all cycles counted since the first one
+static uint32_t cycle_clock_last;
+static uint64_t cycle_clock_total;
+
+// Millisecond clock advanced by 32 bit cycle counter deltas. The time between two reads
+// must stay below one wrap of the cycle counter, otherwise the wrapped periods are lost.
+// The running total is converted as a whole, so counters without a whole number of cycles
+// per millisecond do not gain a rounding error on every read.
+static uint32_t clock_now(void) {
+    uint32_t now;
+
+    K_SPINLOCK(&cycle_clock_lock) {
+        uint32_t cycles = k_cycle_get_32();
+
+        cycle_clock_total += cycles - cycle_clock_last;
+        cycle_clock_last = cycles;
+        now = (uint32_t)k_cyc_to_ms_floor64(cycle_clock_total);
+    }
+
+    return now;
+}
+
+#else
+
+static uint32_t clock_now(void) { return k_uptime_get_32(); }
+
+#endif
+
+uint32_t zmk_input_processor_threshold_temp_layer_timestamp(void) { return clock_now(); }
+
+struct frame_clock {
+    uint32_t now;
+    bool valid;
 };
 
-static void layer_disable_work_handler(struct k_work *work) {
+// Time of the frame being evaluated: the sample timestamp of the driver if it provided one,
+// otherwise the clock. With uptime caching the clock is read at most once per frame no matter
+// how many of the idle gate, decay, velocity and timeout paths need it.
+static uint32_t frame_uptime(struct frame_clock *clock) {
+    if (clock->valid) {
+        return clock->now;
+    }
+
+    uint32_t now = clock_now();
+
+    if (IS_ENABLED(CONFIG_ZMK_INPUT_PROCESSOR_THRESHOLD_TEMP_LAYER_CACHE_UPTIME)) {
+        clock->now = now;
+        clock->valid = true;
+    }
+
+    return now;
+}
+
+// Hand a slot that was just deactivated back to the input path, which resets its accumulators
+// on the next frame. Only called by the path that cleared the active bit. The keymap layer the
+// slot shows goes off before the slot is released, so a new activation can only claim the
+// slot once the previous cycle is complete.
+static void retire_slot(struct threshold_temp_layer_layer_data *layer_data, bool rearm) {
+    atomic_val_t old;
+
+    do {
+        old = atomic_get(&layer_data->generation);
+    } while (!atomic_cas(&layer_data->generation, old, ((old + 2) & ~1) | rearm));
+
+    uint8_t shown = atomic_or(&layer_data->shown_layer, SHOWN_LAYER_RETIRING);
+
+    __ASSERT(!(shown & SHOWN_LAYER_RETIRING), "slot retired twice");
+
+    set_keymap_layer(shown, false);
+    atomic_set(&layer_data->shown_layer, SHOWN_LAYER_NONE);
+}
+
+// Make sure the shared timeout work fires no later than delay_ms from now. Only a delay that
+// is still counting down can be kept: while the handler runs, its slot scan may already be past
+// the caller's slot, so the work is queued again.
+static void arm_timeout(struct threshold_temp_layer_data *data, uint32_t delay_ms) {
+    if (!(k_work_delayable_busy_get(&data->timeout_work) & K_WORK_DELAYED) ||
+        k_ticks_to_ms_ceil32(k_work_delayable_remaining_get(&data->timeout_work)) > delay_ms) {
+        k_work_reschedule(&data->timeout_work, K_MSEC(delay_ms));
+    }
+}
+
+static void timeout_work_handler(struct k_work *work) {
     struct k_work_delayable *d_work = k_work_delayable_from_work(work);
-    struct threshold_temp_layer_layer_data *layer_data =
-        CONTAINER_OF(d_work, struct threshold_temp_layer_layer_data, disable_work);
+    struct threshold_temp_layer_data *data =
+        CONTAINER_OF(d_work, struct threshold_temp_layer_data, timeout_work);
+    const struct threshold_temp_layer_config *cfg = data->dev->config;
+    uint32_t now;
+    uint32_t next = UINT32_MAX;
+    uint32_t scanned = 0;
+    uint32_t retired = 0;
+    uint32_t active;
 
-    // This is a bit hacky - we need to find the device and layer index
-    // Since we can't easily pass additional context, we iterate
-    const struct device *dev = DEVICE_DT_INST_GET(0);
-    struct threshold_temp_layer_data *data = dev->data;
+    // Slots activated while the scan runs may have found the work still busy, pick them up
+    // from a fresh look at the active set before deciding whether to re-arm
+    while ((active = atomic_get(&data->active_layers) & ~scanned) != 0) {
+        scanned |= active;
+        // Read after the active set, so every slot seen has recorded its motion before now
+        now = clock_now();
 
-    for (int i = 0; i < MAX_LAYERS; i++) {
-        if (&data->layers[i] == layer_data && layer_data->active) {
-            layer_data->active = false;
-            layer_data->accumulated_distance = 0;
-            zmk_keymap_layer_deactivate(i);
-            break;
+        while (active) {
+            uint8_t slot = __builtin_ctz(active);
+            struct threshold_temp_layer_layer_data *layer_data = &cfg->layers[slot];
+            struct threshold_temp_layer_predict_data *predict =
+                cfg->predict ? &cfg->predict[slot] : NULL;
+
+            active &= active - 1;
+            if (predict && atomic_get(&predict->speculative)) {
+                uint32_t age = now - predict->activated_at;
+
+                if (age < cfg->predict_confirm_ms) {
+                    next = MIN(next, cfg->predict_confirm_ms - age);
+                    continue;
+                }
+
+                // Motion stopped short of the real threshold, take the prediction back
+                if (atomic_cas(&predict->speculative, 1, 0)) {
+                    if (atomic_and(&data->active_layers, ~BIT(slot)) & BIT(slot)) {
+                        retired |= BIT(slot);
+                        STATS_INC(data, prediction_reverts);
+                        retire_slot(layer_data, false);
+                    }
+                    continue;
+                }
+            }
+
+            if (layer_data->timeout_ms == 0) {
+                continue;
+            }
+
+            // Signed, motion recorded while the scan runs may be newer than now
+            int32_t idle = (int32_t)(now - (uint32_t)atomic_get(&layer_data->last_motion));
+            if (idle < layer_data->timeout_ms) {
+                // Motion arrived since the work was armed, wait for the real deadline
+                next = MIN(next, layer_data->timeout_ms - idle);
+                continue;
+            }
+
+            layer_data->deactivated_at = now;
+            if (!(atomic_and(&data->active_layers, ~BIT(slot)) & BIT(slot))) {
+                // A key press deactivated it first
+                continue;
+            }
+
+            retired |= BIT(slot);
+            STATS_INC(data, timeout_deactivations);
+            retire_slot(layer_data, cfg->rearm_window_ms > 0);
         }
     }
+
+    if (next == UINT32_MAX) {
+        return;
+    }
+
+    __ASSERT(scanned & ~retired, "timeout armed without an active layer");
+
+    // A key press may have cleared the remaining layers meanwhile, then the work stays idle
+    if (atomic_get(&data->active_layers) != 0) {
+        arm_timeout(data, next);
+    }
 }
 
-static int threshold_temp_layer_handle_event(const struct device *dev,
-                                            struct input_event *event,
-                                            uint32_t param1, uint32_t param2,
-                                            struct zmk_input_processor_state *state) {
+// Switch an active slot from the layer it shows to the one of its next tier. The new layer
+// goes on before the old one goes off, so the keymap never falls back in between.
+static void upgrade_tier(struct threshold_temp_layer_data *data,
+                         const struct threshold_temp_layer_config *cfg,
+                         struct threshold_temp_layer_layer_data *layer_data) {
+    uint8_t from =
+        layer_data->tier == 0 ? layer_data->layer : cfg->tiers[2 * layer_data->tier - 1];
+    uint8_t to = cfg->tiers[2 * layer_data->tier + 1];
+
+    layer_data->tier++;
+    set_keymap_layer(to, true);
+
+    if (atomic_cas(&layer_data->shown_layer, from, to)) {
+        STATS_INC(data, tier_upgrades);
+        set_keymap_layer(from, false);
+    } else {
+        // Deactivated meanwhile, the deactivating path froze and turns off the old layer only
+        set_keymap_layer(to, false);
+    }
+}
+
+// Threshold and timeout handling for one completed frame of motion. raw_dx and raw_dy are the
+// frame motion before the filter stage, only used for the trace.
+static void threshold_temp_layer_evaluate_frame(const struct device *dev, int frame_dx,
+                                                int frame_dy, int frame_wheel, int raw_dx,
+                                                int raw_dy, struct frame_clock *clock,
+                                                uint32_t param1, uint32_t param2) {
     struct threshold_temp_layer_data *data = dev->data;
     const struct threshold_temp_layer_config *cfg = dev->config;
-
     uint8_t layer = (uint8_t)param1;
     int16_t timeout = (int16_t)param2;
-    int activation_threshold = cfg->activation_threshold;
 
-    if (layer >= MAX_LAYERS) {
+    if (layer >= MAX_LAYERS || cfg->layer_slots[layer] == 0) {
+        return;
+    }
+
+    uint8_t slot = cfg->layer_slots[layer] - 1;
+    struct threshold_temp_layer_layer_data *layer_data = &cfg->layers[slot];
+    struct threshold_temp_layer_predict_data *predict = cfg->predict ? &cfg->predict[slot] : NULL;
+
+    STATS_INC(data, frames);
+
+    uint32_t generation = atomic_get(&layer_data->generation);
+
+    if (generation != layer_data->generation_seen) {
+        // Deactivated by the timeout work or a key press since the last frame
+        layer_data->generation_seen = generation;
+        reset_accumulation(layer_data, predict);
+        layer_data->rearm = generation & 1;
+    }
+
+    if (!(atomic_get(&data->active_layers) & BIT(slot))) {
+        int32_t require_prior_idle_ms = atomic_get(&layer_data->require_prior_idle_ms);
+
+        if (require_prior_idle_ms > 0) {
+            uint32_t now = frame_uptime(clock);
+            // Signed, a driver timestamp may be older than the last key press
+            int32_t idle = (int32_t)(now - (uint32_t)atomic_get(&data->last_tap_time));
+
+            if (idle < require_prior_idle_ms) {
+                STATS_INC(data, idle_rejections);
+                TRACE_FRAME(raw_dx, raw_dy, layer, TRACE_FLAG_IDLE_GATED, now);
+                return;
+            }
+        }
+
+        bool activate;
+        bool speculative = false;
+
+        if (layer_data->rearm &&
+            (int32_t)(frame_uptime(clock) - layer_data->deactivated_at) >= cfg->rearm_window_ms) {
+            // Motion short of the rearm threshold does not count towards the full one
+            layer_data->rearm = false;
+            reset_accumulation(layer_data, predict);
+        }
+
+        if (layer_data->rearm) {
+            // Resuming shortly after a timeout, only the small rearm threshold has to be crossed
+            layer_data->accumulated_distance +=
+                calculate_distance(cfg->distance_metric, frame_dx, frame_dy) + frame_wheel;
+            activate = layer_data->accumulated_distance >=
+                       (int32_t)atomic_get(&data->rearm_threshold);
+        } else if (cfg->activation_mode == ACTIVATION_MODE_VELOCITY) {
+            int distance =
+                calculate_distance(cfg->distance_metric, frame_dx, frame_dy) + frame_wheel;
+
+            activate = update_velocity(cfg, layer_data, distance,
+                                       frame_uptime(clock)) >= cfg->velocity_threshold;
+        } else {
+            if (cfg->decay_per_ms > 0) {
+                decay_distance(cfg, layer_data, frame_uptime(clock));
+            }
+
+            int distance =
+                calculate_distance(cfg->distance_metric, frame_dx, frame_dy) + frame_wheel;
+            int32_t threshold = atomic_get(&layer_data->activation_threshold);
+
+            layer_data->accumulated_distance += distance;
+            activate = layer_data->accumulated_distance >= threshold;
+
+            if (!activate && predict) {
+                speculative = predict_crossing(cfg, layer_data, predict, distance, threshold);
+                activate = speculative;
+            }
+        }
+
+        if (activate) {
+            layer_data->rearm = false;
+            // Published by the atomic_or below, before the timeout work can look at the slot
+            layer_data->timeout_ms = MAX(timeout, 0);
+            atomic_set(&layer_data->last_motion, frame_uptime(clock));
+
+            // A frame of another listener may have won the activation meanwhile, or the slot
+            // may still be turning off its layer after a deactivation
+            activate = atomic_cas(&layer_data->shown_layer, SHOWN_LAYER_NONE, layer);
+        }
+
+        if (activate) {
+            STATS_INC(data, activations);
+
+            // The layer goes on and the prediction state is written before the active bit
+            // publishes the slot. A key press or the timeout work can only deactivate what the
+            // bit shows, so neither can retire the slot before its layer is on.
+            set_keymap_layer(layer, true);
+
+            if (predict) {
+                predict->activated_at = frame_uptime(clock);
+                atomic_set(&predict->speculative, speculative);
+            }
+
+            atomic_or(&data->active_layers, BIT(slot));
+
+            if (speculative) {
+                arm_timeout(data, cfg->predict_confirm_ms);
+            }
+
+            if (timeout > 0) {
+                arm_timeout(data, timeout);
+            }
+        }
+
+        TRACE_FRAME(raw_dx, raw_dy, layer, activate ? TRACE_FLAG_ACTIVATED : 0,
+                    frame_uptime(clock));
+    } else {
+        bool speculative = predict && atomic_get(&predict->speculative);
+
+        if (speculative || layer_data->tier < cfg->num_tiers) {
+            // Keep counting until the prediction is confirmed and all tiers are reached
+            layer_data->accumulated_distance +=
+                calculate_distance(cfg->distance_metric, frame_dx, frame_dy) + frame_wheel;
+
+            if (speculative && layer_data->accumulated_distance >=
+                                   (int32_t)atomic_get(&layer_data->activation_threshold)) {
+                atomic_cas(&predict->speculative, 1, 0);
+            }
+
+            if (layer_data->accumulated_distance >=
+                (int32_t)atomic_get(&data->tier_thresholds[layer_data->tier])) {
+                upgrade_tier(data, cfg, layer_data);
+            }
+        }
+
+        if (layer_data->timeout_ms > 0) {
+            // Lazy timeout: only record the motion, the pending work extends itself when it fires
+            atomic_set(&layer_data->last_motion, frame_uptime(clock));
+        }
+
+        TRACE_FRAME(raw_dx, raw_dy, layer, TRACE_FLAG_ACTIVE, frame_uptime(clock));
+    }
+}
+
+// Drop motion inside the dead zone and, with sign_filter, the first frame after a direction
+// change, so alternating +-1 jitter never reaches the accumulators. Then apply the axis weight.
+static int32_t filter_axis(int32_t value, uint8_t dead_zone, uint8_t weight, bool sign_filter,
+                           int8_t *last_sign) {
+    if (abs(value) <= dead_zone) {
         return 0;
     }
 
-    struct threshold_temp_layer_layer_data *layer_data = &data->layers[layer];
+    if (sign_filter) {
+        int8_t sign = value > 0 ? 1 : -1;
+        bool flipped = *last_sign != 0 && sign != *last_sign;
 
-    if (!layer_data->active && cfg->require_prior_idle_ms > 0) {
-        int64_t now = k_uptime_get();
-        if ((now - data->last_tap_time) < cfg->require_prior_idle_ms) {
+        *last_sign = sign;
+        if (flipped) {
             return 0;
         }
     }
 
-    if (event->type == INPUT_EV_REL) {
-        if (event->code == INPUT_REL_X || event->code == INPUT_REL_Y) {
-            static int pending_dx = 0;
-            static int pending_dy = 0;
+    return value * weight;
+}
 
-            if (event->code == INPUT_REL_X) {
-                pending_dx = event->value;
-            } else if (event->code == INPUT_REL_Y) {
-                pending_dy = event->value;
-            }
+static int threshold_temp_layer_process_events(const struct device *dev,
+                                              const struct input_event *events, size_t count,
+                                              struct frame_clock *clock, uint32_t param1,
+                                              uint32_t param2,
+                                              struct zmk_input_processor_state *state) {
+    struct threshold_temp_layer_data *data = dev->data;
+    const struct threshold_temp_layer_config *cfg = dev->config;
+    // Listeners beyond the configured count share the last frame buffer
+    uint8_t listener = state ? MIN(state->input_device_index, MAX_LISTENERS - 1) : 0;
+    struct threshold_temp_layer_frame *frame = &data->frames[listener];
+    bool motion = false;
+    bool sync = false;
 
-            if (!layer_data->active) {
-                int distance = calculate_distance(pending_dx, pending_dy);
-                layer_data->accumulated_distance += distance;
+    // Classify first, so events that can never complete a motion frame leave before any
+    // state lookup or clock read
+    for (size_t i = 0; i < count; i++) {
+        const struct input_event *event = &events[i];
 
-                if (layer_data->accumulated_distance >= activation_threshold) {
-                    layer_data->active = true;
-                    zmk_keymap_layer_activate(layer);
-                }
-            }
+        sync |= event->sync;
 
-            pending_dx = 0;
-            pending_dy = 0;
+        if (event->type != INPUT_EV_REL) {
+            continue;
+        }
 
-            if (layer_data->active && timeout > 0) {
-                k_work_reschedule(&layer_data->disable_work, K_MSEC(timeout));
+        switch (event->code) {
+        case INPUT_REL_X:
+            frame->dx += event->value;
+            motion = true;
+            break;
+        case INPUT_REL_Y:
+            frame->dy += event->value;
+            motion = true;
+            break;
+        case INPUT_REL_WHEEL:
+        case INPUT_REL_HWHEEL:
+            if (cfg->wheel_weight > 0) {
+                frame->wheel += abs(event->value);
+                motion = true;
             }
+            break;
+        default:
+            break;
         }
     }
 
+    // In frame mode, wait for the sync flag so all axes of a report are seen together.
+    // Otherwise every call that carries motion is a frame of its own.
+    if (cfg->frame_accumulation ? !sync : !motion) {
+        return 0;
+    }
+
+    if (!motion && frame->dx == 0 && frame->dy == 0 && frame->wheel == 0) {
+        return 0;
+    }
+
+    int raw_dx = frame->dx;
+    int raw_dy = frame->dy;
+    int frame_dx =
+        filter_axis(raw_dx, cfg->dead_zone_x, cfg->x_weight, cfg->sign_filter, &frame->sign_x);
+    int frame_dy =
+        filter_axis(raw_dy, cfg->dead_zone_y, cfg->y_weight, cfg->sign_filter, &frame->sign_y);
+    int frame_wheel = frame->wheel * cfg->wheel_weight;
+
+    frame->dx = 0;
+    frame->dy = 0;
+    frame->wheel = 0;
+
+    // Pure sensor noise neither accumulates nor keeps an active layer alive. It is still
+    // traced, the filter settings are tuned against exactly this noise.
+    if (frame_dx == 0 && frame_dy == 0 && frame_wheel == 0) {
+        TRACE_FRAME(raw_dx, raw_dy, (uint8_t)param1, TRACE_FLAG_FILTERED, frame_uptime(clock));
+        return 0;
+    }
+
+    threshold_temp_layer_evaluate_frame(dev, frame_dx, frame_dy, frame_wheel, raw_dx, raw_dy,
+                                        clock, param1, param2);
+
     return 0;
 }
 
+static int threshold_temp_layer_dispatch(const struct device *dev,
+                                         const struct input_event *events, size_t count,
+                                         struct frame_clock *clock, uint32_t param1,
+                                         uint32_t param2,
+                                         struct zmk_input_processor_state *state) {
+#if defined(CONFIG_ZMK_INPUT_PROCESSOR_THRESHOLD_TEMP_LAYER_STATS)
+    struct threshold_temp_layer_data *data = dev->data;
+    // The timing API counts CPU cycles, k_cycle_get_32() is only the system timer on most SoCs
+    timing_t start = timing_counter_get();
+    int ret =
+        threshold_temp_layer_process_events(dev, events, count, clock, param1, param2, state);
+    timing_t end = timing_counter_get();
+    uint32_t cycles = MIN(timing_cycles_get(&start, &end), UINT32_MAX);
+    int bucket = cycles ? MIN(32 - __builtin_clz(cycles), STATS_CYCLE_BUCKETS - 1) : 0;
+
+    atomic_add(&data->stats.events, count);
+    atomic_inc(&data->stats.cycles[bucket]);
+#if CONFIG_ZMK_INPUT_PROCESSOR_THRESHOLD_TEMP_LAYER_CYCLE_BUDGET > 0
+    if (cycles > CONFIG_ZMK_INPUT_PROCESSOR_THRESHOLD_TEMP_LAYER_CYCLE_BUDGET) {
+        atomic_inc(&data->stats.budget_overruns);
+    }
+#endif
+
+    return ret;
+#else
+    return threshold_temp_layer_process_events(dev, events, count, clock, param1, param2, state);
+#endif
+}
+
+int zmk_input_processor_threshold_temp_layer_handle_events(
+    const struct device *dev, const struct input_event *events, size_t count, uint32_t param1,
+    uint32_t param2, struct zmk_input_processor_state *state) {
+    struct frame_clock clock = {.valid = false};
+
+    return threshold_temp_layer_dispatch(dev, events, count, &clock, param1, param2, state);
+}
+
+int zmk_input_processor_threshold_temp_layer_handle_events_at(
+    const struct device *dev, const struct input_event *events, size_t count, uint32_t timestamp,
+    uint32_t param1, uint32_t param2, struct zmk_input_processor_state *state) {
+    struct frame_clock clock = {.now = timestamp, .valid = true};
+
+    return threshold_temp_layer_dispatch(dev, events, count, &clock, param1, param2, state);
+}
+
+static int threshold_temp_layer_handle_event(const struct device *dev,
+                                            struct input_event *event,
+                                            uint32_t param1, uint32_t param2,
+                                            struct zmk_input_processor_state *state) {
+    return zmk_input_processor_threshold_temp_layer_handle_events(dev, event, 1, param1, param2,
+                                                                  state);
+}
+
+#define KEYMAP_NODE DT_INST(0, zmk_keymap)
+
+#if DT_NODE_EXISTS(KEYMAP_NODE)
+
+#define BINDING_IS_BOUND(node_id, prop, idx)                                               \
+    !(DT_NODE_HAS_COMPAT(DT_PHANDLE_BY_IDX(node_id, prop, idx), zmk_behavior_transparent) || \
+      DT_NODE_HAS_COMPAT(DT_PHANDLE_BY_IDX(node_id, prop, idx), zmk_behavior_none))
+
+#define BOUND_POSITION_BIT(node_id, prop, idx, word)                                       \
+    (((idx) / 32 == (word) && BINDING_IS_BOUND(node_id, prop, idx)) ? BIT((idx) % 32) : 0) |
+
+#define BOUND_POSITIONS_WORD(word, node_id)                                                \
+    (DT_FOREACH_PROP_ELEM_VARGS(node_id, bindings, BOUND_POSITION_BIT, word) 0)
+
+#define KEYMAP_LAYER_BOUND_POSITIONS(node_id)                                              \
+    {LISTIFY(POSITION_BITMAP_WORDS, BOUND_POSITIONS_WORD, (, ), node_id)}
+
+// Per keymap layer, the positions that have a binding other than &trans or &none
+static const uint32_t keymap_bound_positions[][POSITION_BITMAP_WORDS] = {
+    DT_FOREACH_CHILD_SEP(KEYMAP_NODE, KEYMAP_LAYER_BOUND_POSITIONS, (, ))};
+
+// Active slots whose layer would not handle a press of this position itself
+static uint32_t unbound_slots(const struct threshold_temp_layer_config *cfg, uint32_t active,
+                              uint32_t position) {
+    uint32_t unbound = 0;
+
+    while (active) {
+        uint8_t slot = __builtin_ctz(active);
+        // The layer on screen, which after a tier upgrade is the one of the tier. A slot being
+        // retired shows no valid layer and is left to its deactivating path.
+        uint8_t layer = atomic_get(&cfg->layers[slot].shown_layer);
+
+        active &= active - 1;
+        if (layer >= ARRAY_SIZE(keymap_bound_positions) || position >= POSITION_BITMAP_WORDS * 32 ||
+            !(keymap_bound_positions[layer][position / 32] & BIT(position % 32))) {
+            unbound |= BIT(slot);
+        }
+    }
+
+    return unbound;
+}
+
+#else
+
+static uint32_t unbound_slots(const struct threshold_temp_layer_config *cfg, uint32_t active,
+                              uint32_t position) {
+    return active;
+}
+
+#endif
+
+static void threshold_temp_layer_position_changed(const struct device *dev,
+                                                 const struct zmk_position_state_changed *ev) {
+    const struct threshold_temp_layer_config *cfg = dev->config;
+    struct threshold_temp_layer_data *data = dev->data;
+
+    if (ev->position < POSITION_BITMAP_WORDS * 32 &&
+        (cfg->excluded_positions[ev->position / 32] & BIT(ev->position % 32))) {
+        return;
+    }
+
+    if (ev->state) {
+        atomic_set(&data->last_tap_time, clock_now());
+    }
+
+    // With the release policy a press only restarts the idle gate
+    bool deactivate = cfg->deactivate_policy == DEACTIVATE_POLICY_RELEASE ? !ev->state : ev->state;
+
+    // Nothing to deactivate, leave with one compare instead of a read-modify-write
+    if (!deactivate || atomic_get(&data->active_layers) == 0) {
+        return;
+    }
+
+    uint32_t mask = UINT32_MAX;
+
+    if (cfg->deactivate_policy == DEACTIVATE_POLICY_UNBOUND_KEYS) {
+        // Keys bound on the temp layer are meant to be used there, so they keep it active
+        mask = unbound_slots(cfg, atomic_get(&data->active_layers), ev->position);
+    }
+
+    // Exactly the layers whose bits this clear removed are ours to deactivate
+    uint32_t active = atomic_and(&data->active_layers, ~mask) & mask;
+
+    if (active == 0) {
+        return;
+    }
+
+    while (active) {
+        struct threshold_temp_layer_layer_data *layer_data = &cfg->layers[__builtin_ctz(active)];
+
+        active &= active - 1;
+        STATS_INC(data, keypress_deactivations);
+        retire_slot(layer_data, false);
+    }
+
+    // Layers that stay active still need the shared timeout work. A racing activation may
+    // have armed it just before the cancel, so look again afterwards.
+    if (atomic_get(&data->active_layers) == 0) {
+        k_work_cancel_delayable(&data->timeout_work);
+
+        if (atomic_get(&data->active_layers) != 0) {
+            k_work_reschedule(&data->timeout_work, K_NO_WAIT);
+        }
+    }
+}
+
+#define THRESHOLD_TEMP_LAYER_DEV(n) DEVICE_DT_INST_GET(n),
+
+static const struct device *const threshold_temp_layer_devs[] = {
+    DT_INST_FOREACH_STATUS_OKAY(THRESHOLD_TEMP_LAYER_DEV)};
+
 static int handle_position_state_changed(const zmk_event_t *eh) {
     struct zmk_position_state_changed *ev = as_zmk_position_state_changed(eh);
     if (ev == NULL) {
         return 0;
     }
 
-    const struct device *dev = DEVICE_DT_INST_GET(0);
+    for (int i = 0; i < ARRAY_SIZE(threshold_temp_layer_devs); i++) {
+        threshold_temp_layer_position_changed(threshold_temp_layer_devs[i], ev);
+    }
+
+    return 0;
+}
+
+ZMK_LISTENER(threshold_temp_layer, handle_position_state_changed);
+ZMK_SUBSCRIPTION(threshold_temp_layer, zmk_position_state_changed);
+
+#if defined(CONFIG_ZMK_INPUT_PROCESSOR_THRESHOLD_TEMP_LAYER_SETTINGS)
+
+#define SETTINGS_PREFIX "ttl"
+
+// Stored per layer rather than per slot, so a changed layers property keeps matching values
+struct threshold_temp_layer_settings_record {
+    uint8_t layer;
+    int16_t require_prior_idle_ms;
+    int32_t activation_threshold;
+};
+
+static void save_work_handler(struct k_work *work) {
+    struct threshold_temp_layer_data *data = CONTAINER_OF(
+        k_work_delayable_from_work(work), struct threshold_temp_layer_data, save_work);
+    const struct threshold_temp_layer_config *cfg = data->dev->config;
+    struct threshold_temp_layer_settings_record records[MAX_LAYERS];
+    char key[48];
+
+    for (int i = 0; i < cfg->num_slots; i++) {
+        records[i] = (struct threshold_temp_layer_settings_record){
+            .layer = cfg->layers[i].layer,
+            .require_prior_idle_ms = atomic_get(&cfg->layers[i].require_prior_idle_ms),
+            .activation_threshold = cfg->layers[i].threshold_setting,
+        };
+    }
+
+    snprintf(key, sizeof(key), SETTINGS_PREFIX "/%s", data->dev->name);
+
+    int err = settings_save_one(key, records, cfg->num_slots * sizeof(records[0]));
+    if (err < 0) {
+        LOG_ERR("Failed to save %s: %d", key, err);
+    }
+}
+
+static int threshold_temp_layer_settings_set(const char *name, size_t len,
+                                             settings_read_cb read_cb, void *cb_arg) {
+    for (int i = 0; i < ARRAY_SIZE(threshold_temp_layer_devs); i++) {
+        const struct device *dev = threshold_temp_layer_devs[i];
+        const struct threshold_temp_layer_config *cfg = dev->config;
+        struct threshold_temp_layer_settings_record records[MAX_LAYERS];
+        const char *next;
+
+        if (!settings_name_steq(name, dev->name, &next) || next != NULL) {
+            continue;
+        }
+
+        if (len % sizeof(records[0]) != 0 || len > sizeof(records)) {
+            return -EINVAL;
+        }
+
+        int err = read_cb(cb_arg, records, len);
+        if (err < 0) {
+            return err;
+        }
+
+        for (int j = 0; j < len / sizeof(records[0]); j++) {
+            uint8_t layer = records[j].layer;
+
+            if (layer >= MAX_LAYERS || cfg->layer_slots[layer] == 0) {
+                continue;
+            }
+
+            struct threshold_temp_layer_layer_data *layer_data =
+                &cfg->layers[cfg->layer_slots[layer] - 1];
+
+            set_threshold(dev->data, layer_data, records[j].activation_threshold);
+            atomic_set(&layer_data->require_prior_idle_ms, records[j].require_prior_idle_ms);
+        }
+
+        return 0;
+    }
+
+    return -ENOENT;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(threshold_temp_layer, SETTINGS_PREFIX, NULL,
+                               threshold_temp_layer_settings_set, NULL, NULL);
+
+#endif
+
+static void schedule_save(const struct device *dev) {
+#if defined(CONFIG_ZMK_INPUT_PROCESSOR_THRESHOLD_TEMP_LAYER_SETTINGS)
+    struct threshold_temp_layer_data *data = dev->data;
+
+    k_work_reschedule(&data->save_work, K_MSEC(CONFIG_ZMK_SETTINGS_SAVE_DEBOUNCE));
+#endif
+}
+
+int zmk_input_processor_threshold_temp_layer_adjust(const struct device *dev,
+                                                    int32_t threshold_delta,
+                                                    int32_t idle_delta) {
+    struct threshold_temp_layer_data *data = dev->data;
     const struct threshold_temp_layer_config *cfg = dev->config;
+
+    for (int i = 0; i < cfg->num_slots; i++) {
+        struct threshold_temp_layer_layer_data *layer_data = &cfg->layers[i];
+        int64_t threshold = (int64_t)layer_data->threshold_setting + threshold_delta;
+        int64_t idle = (int64_t)atomic_get(&layer_data->require_prior_idle_ms) + idle_delta;
+
+        // Each value is a single word, so the input path sees either the old or the new one
+        set_threshold(data, layer_data, CLAMP(threshold, 0, INT32_MAX));
+        atomic_set(&layer_data->require_prior_idle_ms, CLAMP(idle, 0, INT16_MAX));
+    }
+
+    LOG_DBG("%s: threshold %+d idle %+d ms", dev->name, threshold_delta, idle_delta);
+    schedule_save(dev);
+
+    return 0;
+}
+
+int zmk_input_processor_threshold_temp_layer_reset_tuning(const struct device *dev) {
     struct threshold_temp_layer_data *data = dev->data;
+    const struct threshold_temp_layer_config *cfg = dev->config;
 
-    for (int i = 0; i < cfg->excluded_positions_len; i++) {
-        if (cfg->excluded_positions[i] == ev->position) {
-            return 0;
-        }
+    for (int i = 0; i < cfg->num_slots; i++) {
+        set_threshold(data, &cfg->layers[i], cfg->layer_configs[i].activation_threshold);
+        atomic_set(&cfg->layers[i].require_prior_idle_ms,
+                   cfg->layer_configs[i].require_prior_idle_ms);
     }
 
-    if (ev->state) {
-        data->last_tap_time = k_uptime_get();
-
-        for (int i = 0; i < MAX_LAYERS; i++) {
-            if (data->layers[i].active) {
-                data->layers[i].active = false;
-                data->layers[i].accumulated_distance = 0;
-                k_work_cancel_delayable(&data->layers[i].disable_work);
-                zmk_keymap_layer_deactivate(i);
-            }
+    schedule_save(dev);
+
+    return 0;
+}
+
+int zmk_input_processor_threshold_temp_layer_set_cpi(const struct device *dev, uint16_t cpi) {
+    struct threshold_temp_layer_data *data = dev->data;
+    const struct threshold_temp_layer_config *cfg = dev->config;
+
+    if (cfg->cpi == 0) {
+        // Thresholds are in counts, there is nothing to rescale
+        return -ENOTSUP;
+    }
+
+    if (cpi == 0) {
+        return -EINVAL;
+    }
+
+    data->cpi = cpi;
+    atomic_set(&data->rearm_threshold, threshold_counts(cpi, cfg->rearm_threshold));
+    set_tier_thresholds(data, cfg);
+
+    for (int i = 0; i < cfg->num_slots; i++) {
+        set_threshold(data, &cfg->layers[i], cfg->layers[i].threshold_setting);
+    }
+
+    LOG_DBG("%s: rescaled thresholds for %d cpi", dev->name, cpi);
+
+    return 0;
+}
+
+#if defined(CONFIG_ZTEST)
+
+bool zmk_input_processor_threshold_temp_layer_timer_pending(const struct device *dev) {
+    struct threshold_temp_layer_data *data = dev->data;
+
+    return k_work_delayable_busy_get(&data->timeout_work) != 0;
+}
+
+#endif
+
+#if defined(CONFIG_ZMK_INPUT_PROCESSOR_THRESHOLD_TEMP_LAYER_STATS) &&                      \
+    (defined(CONFIG_SHELL) || CONFIG_ZMK_INPUT_PROCESSOR_THRESHOLD_TEMP_LAYER_STATS_LOG_INTERVAL > 0)
+
+#if defined(CONFIG_SHELL)
+#define STATS_OUT(sh, ...)                                                                 \
+    do {                                                                                   \
+        if (sh) {                                                                          \
+            shell_print(sh, __VA_ARGS__);                                                  \
+        } else {                                                                           \
+            LOG_INF(__VA_ARGS__);                                                          \
+        }                                                                                  \
+    } while (0)
+#define STATS_WARN(sh, ...)                                                                \
+    do {                                                                                   \
+        if (sh) {                                                                          \
+            shell_warn(sh, __VA_ARGS__);                                                   \
+        } else {                                                                           \
+            LOG_WRN(__VA_ARGS__);                                                          \
+        }                                                                                  \
+    } while (0)
+#else
+struct shell;
+#define STATS_OUT(sh, ...) LOG_INF(__VA_ARGS__)
+#define STATS_WARN(sh, ...) LOG_WRN(__VA_ARGS__)
+#endif
+
+static void stats_report(const struct shell *sh) {
+    for (int i = 0; i < ARRAY_SIZE(threshold_temp_layer_devs); i++) {
+        const struct device *dev = threshold_temp_layer_devs[i];
+        struct threshold_temp_layer_stats *stats =
+            &((struct threshold_temp_layer_data *)dev->data)->stats;
+        char hist[STATS_CYCLE_BUCKETS * 11 + 1];
+        int len = 0;
+
+        for (int b = 0; b < STATS_CYCLE_BUCKETS; b++) {
+            len += snprintf(&hist[len], sizeof(hist) - len, " %u",
+                            (unsigned int)atomic_get(&stats->cycles[b]));
+        }
+
+        STATS_OUT(sh, "%s: events %u frames %u activations %u tier-upgrades %u idle-rejected %u",
+                  dev->name, (unsigned int)atomic_get(&stats->events),
+                  (unsigned int)atomic_get(&stats->frames),
+                  (unsigned int)atomic_get(&stats->activations),
+                  (unsigned int)atomic_get(&stats->tier_upgrades),
+                  (unsigned int)atomic_get(&stats->idle_rejections));
+        STATS_OUT(sh, "%s: deactivations timeout %u keypress %u prediction-reverted %u",
+                  dev->name, (unsigned int)atomic_get(&stats->timeout_deactivations),
+                  (unsigned int)atomic_get(&stats->keypress_deactivations),
+                  (unsigned int)atomic_get(&stats->prediction_reverts));
+        STATS_OUT(sh, "%s: handler cycles log2 histogram:%s", dev->name, hist);
+
+#if CONFIG_ZMK_INPUT_PROCESSOR_THRESHOLD_TEMP_LAYER_CYCLE_BUDGET > 0
+        unsigned int overruns = atomic_get(&stats->budget_overruns);
+
+        if (overruns > 0) {
+            STATS_WARN(sh, "%s: %u handler calls over the budget of %d cycles", dev->name,
+                       overruns, CONFIG_ZMK_INPUT_PROCESSOR_THRESHOLD_TEMP_LAYER_CYCLE_BUDGET);
         }
+#endif
     }
+}
+
+#if CONFIG_ZMK_INPUT_PROCESSOR_THRESHOLD_TEMP_LAYER_STATS_LOG_INTERVAL > 0
+
+static void stats_log_work_handler(struct k_work *work) {
+    stats_report(NULL);
+    k_work_schedule(k_work_delayable_from_work(work),
+                    K_SECONDS(CONFIG_ZMK_INPUT_PROCESSOR_THRESHOLD_TEMP_LAYER_STATS_LOG_INTERVAL));
+}
+
+static K_WORK_DELAYABLE_DEFINE(stats_log_work, stats_log_work_handler);
+
+#endif
 
+#if defined(CONFIG_SHELL)
+
+static int cmd_stats(const struct shell *sh, size_t argc, char **argv) {
+    stats_report(sh);
     return 0;
 }
 
-ZMK_LISTENER(threshold_temp_layer, handle_position_state_changed);
-ZMK_SUBSCRIPTION(threshold_temp_layer, zmk_position_state_changed);
+static int cmd_stats_reset(const struct shell *sh, size_t argc, char **argv) {
+    for (int i = 0; i < ARRAY_SIZE(threshold_temp_layer_devs); i++) {
+        struct threshold_temp_layer_data *data = threshold_temp_layer_devs[i]->data;
+
+        memset(&data->stats, 0, sizeof(data->stats));
+    }
+
+    return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_threshold_temp_layer,
+                               SHELL_CMD(stats, NULL, "Show statistics", cmd_stats),
+                               SHELL_CMD(reset, NULL, "Reset statistics", cmd_stats_reset),
+                               SHELL_SUBCMD_SET_END);
+
+SHELL_CMD_REGISTER(threshold_temp_layer, &sub_threshold_temp_layer,
+                   "Threshold temp layer input processor", NULL);
+
+#endif // defined(CONFIG_SHELL)
+
+#endif
 
 static int threshold_temp_layer_init(const struct device *dev) {
     struct threshold_temp_layer_data *data = dev->data;
+    const struct threshold_temp_layer_config *cfg = dev->config;
+
+    data->dev = dev;
+    atomic_set(&data->last_tap_time, 0);
+    atomic_set(&data->active_layers, 0);
+    data->cpi = cfg->cpi;
+    atomic_set(&data->rearm_threshold, threshold_counts(cfg->cpi, cfg->rearm_threshold));
 
-    data->last_tap_time = 0;
+    set_tier_thresholds(data, cfg);
+#if defined(CONFIG_ZMK_INPUT_PROCESSOR_THRESHOLD_TEMP_LAYER_STATS)
+    timing_init();
+    timing_start();
+#endif
+    k_work_init_delayable(&data->timeout_work, timeout_work_handler);
+#if defined(CONFIG_ZMK_INPUT_PROCESSOR_THRESHOLD_TEMP_LAYER_SETTINGS)
+    k_work_init_delayable(&data->save_work, save_work_handler);
+#endif
 
     for (int i = 0; i < MAX_LAYERS; i++) {
-        data->layers[i].accumulated_distance = 0;
-        data->layers[i].active = false;
-        k_work_init_delayable(&data->layers[i].disable_work, layer_disable_work_handler);
+        if (cfg->layer_slots[i] == 0) {
+            continue;
+        }
+
+        uint8_t slot = cfg->layer_slots[i] - 1;
+        struct threshold_temp_layer_layer_data *layer_data = &cfg->layers[slot];
+
+        layer_data->layer = i;
+        layer_data->timeout_ms = 0;
+        set_threshold(data, layer_data, cfg->layer_configs[slot].activation_threshold);
+        atomic_set(&layer_data->require_prior_idle_ms,
+                   cfg->layer_configs[slot].require_prior_idle_ms);
+        reset_accumulation(layer_data, cfg->predict ? &cfg->predict[slot] : NULL);
+        layer_data->rearm = false;
+        atomic_set(&layer_data->generation, 0);
+        layer_data->generation_seen = 0;
+        atomic_set(&layer_data->last_motion, 0);
+        atomic_set(&layer_data->shown_layer, SHOWN_LAYER_NONE);
+        if (cfg->predict) {
+            atomic_set(&cfg->predict[slot].speculative, 0);
+        }
     }
 
+#if defined(CONFIG_ZMK_INPUT_PROCESSOR_THRESHOLD_TEMP_LAYER_STATS) &&                      \
+    CONFIG_ZMK_INPUT_PROCESSOR_THRESHOLD_TEMP_LAYER_STATS_LOG_INTERVAL > 0
+    k_work_schedule(&stats_log_work,
+                    K_SECONDS(CONFIG_ZMK_INPUT_PROCESSOR_THRESHOLD_TEMP_LAYER_STATS_LOG_INTERVAL));
+#endif
+
     return 0;
 }
 
@@ -183,15 +1391,135 @@ static struct zmk_input_processor_driver_api threshold_temp_layer_driver_api = {
     .handle_event = threshold_temp_layer_handle_event,
 };
 
+// Checks of one tiers pair, true when the pair is not set. The pairs are spelled out in the
+// BUILD_ASSERTs below, because devicetree indices have to be literal tokens.
+#define TIER_LAYER_VALID(n, idx)                                                           \
+    COND_CODE_1(DT_INST_PROP_HAS_IDX(n, tiers, idx),                                       \
+                (DT_INST_PROP_BY_IDX(n, tiers, idx) >= 0 &&                                \
+                 DT_INST_PROP_BY_IDX(n, tiers, idx) < MAX_LAYERS),                         \
+                (1))
+
+#define TIER_SORTED(n, idx, prev)                                                          \
+    COND_CODE_1(DT_INST_PROP_HAS_IDX(n, tiers, idx),                                       \
+                (DT_INST_PROP_BY_IDX(n, tiers, idx) > DT_INST_PROP_BY_IDX(n, tiers, prev)), \
+                (1))
+
+#define EXCLUDED_POSITION_BIT(node_id, prop, idx, word)                                    \
+    ((DT_PROP_BY_IDX(node_id, prop, idx) / 32) == (word)                                   \
+         ? BIT(DT_PROP_BY_IDX(node_id, prop, idx) % 32)                                    \
+         : 0) |
+
+#define EXCLUDED_POSITIONS_WORD(word, n)                                                   \
+    (DT_INST_FOREACH_PROP_ELEM_VARGS(n, excluded_positions, EXCLUDED_POSITION_BIT, word) 0)
+
+// Without a layers property every keymap layer gets its own slot
+#define IDENTITY_LAYER_SLOT(i, _) ((i) + 1)
+
+#define DECLARED_LAYER_SLOT(node_id, prop, idx) [DT_PROP_BY_IDX(node_id, prop, idx)] = (idx) + 1,
+
+#define THRESHOLD_TEMP_LAYER_LAYER_SLOTS(n)                                                \
+    COND_CODE_0(DT_INST_PROP_LEN(n, layers),                                               \
+                ({LISTIFY(MAX_LAYERS, IDENTITY_LAYER_SLOT, (, ), _)}),                     \
+                ({DT_INST_FOREACH_PROP_ELEM(n, layers, DECLARED_LAYER_SLOT)}))
+
+#define THRESHOLD_TEMP_LAYER_NUM_SLOTS(n)                                                  \
+    COND_CODE_0(DT_INST_PROP_LEN(n, layers), (MAX_LAYERS), (DT_INST_PROP_LEN(n, layers)))
+
+// A child node whose layer matches overrides the instance value, otherwise it is inherited
+#define CHILD_LAYER_PROP(child, layer_idx, prop, n)                                        \
+    (DT_PROP(child, layer) == (layer_idx)) ? DT_PROP_OR(child, prop, DT_INST_PROP(n, prop)) :
+
+#define LAYER_PROP(n, layer_idx, prop)                                                     \
+    (DT_INST_FOREACH_CHILD_VARGS(n, CHILD_LAYER_PROP, layer_idx, prop, n) DT_INST_PROP(n, prop))
+
+#define LAYER_CONFIG(n, layer_idx)                                                         \
+    {                                                                                      \
+        .activation_threshold = LAYER_PROP(n, layer_idx, activation_threshold),            \
+        .require_prior_idle_ms = LAYER_PROP(n, layer_idx, require_prior_idle_ms),          \
+    }
+
+#define IDENTITY_LAYER_CONFIG(i, n) LAYER_CONFIG(n, i)
+
+#define DECLARED_LAYER_CONFIG(node_id, prop, idx, n)                                       \
+    LAYER_CONFIG(n, DT_PROP_BY_IDX(node_id, prop, idx))
+
+#define THRESHOLD_TEMP_LAYER_LAYER_CONFIGS(n)                                              \
+    COND_CODE_0(DT_INST_PROP_LEN(n, layers),                                               \
+                (LISTIFY(MAX_LAYERS, IDENTITY_LAYER_CONFIG, (, ), n)),                     \
+                (DT_INST_FOREACH_PROP_ELEM_SEP_VARGS(n, layers, DECLARED_LAYER_CONFIG, (, ), n)))
+
 #define THRESHOLD_TEMP_LAYER_INST(n)                                                         \
-    BUILD_ASSERT(DT_INST_PROP_LEN(n, excluded_positions) <= UINT8_MAX,                    \
-                 "excluded-positions must have at most 255 items");                        \
-    static const uint8_t excluded_positions_##n[] = DT_INST_PROP(n, excluded_positions);    \
+    BUILD_ASSERT(DT_INST_PROP_LEN(n, layers) <= MAX_LAYERS,                                \
+                 "layers must have at most 16 items");                                     \
+    BUILD_ASSERT(DT_INST_PROP(n, velocity_smoothing) <= 8,                                 \
+                 "velocity-smoothing must be at most 8");                                  \
+    BUILD_ASSERT(DT_INST_ENUM_IDX(n, activation_mode) != ACTIVATION_MODE_VELOCITY ||       \
+                     DT_INST_PROP(n, frame_accumulation),                                  \
+                 "velocity activation-mode needs frame-accumulation");                     \
+    BUILD_ASSERT(DT_INST_PROP(n, wheel_weight) <= UINT8_MAX,                               \
+                 "wheel-weight must be at most 255");                                      \
+    BUILD_ASSERT(DT_INST_PROP(n, cpi) <= UINT16_MAX, "cpi must be at most 65535");         \
+    BUILD_ASSERT(DT_INST_PROP(n, dead_zone_x) <= UINT8_MAX &&                              \
+                     DT_INST_PROP(n, dead_zone_y) <= UINT8_MAX,                            \
+                 "dead-zone-x and dead-zone-y must be at most 255");                       \
+    BUILD_ASSERT(DT_INST_PROP(n, x_weight) <= UINT8_MAX &&                                 \
+                     DT_INST_PROP(n, y_weight) <= UINT8_MAX,                               \
+                 "x-weight and y-weight must be at most 255");                             \
+    BUILD_ASSERT(DT_INST_PROP(n, predict_frames) <= PREDICT_MAX_FRAMES,                    \
+                 "predict-frames must be at most 4");                                      \
+    BUILD_ASSERT(DT_INST_PROP_LEN(n, tiers) % 2 == 0 &&                                    \
+                     DT_INST_PROP_LEN(n, tiers) <= 2 * MAX_TIERS,                          \
+                 "tiers must be at most 4 <threshold layer> pairs");                       \
+    BUILD_ASSERT(DT_INST_PROP_LEN(n, tiers) == 0 ||                                        \
+                     DT_INST_ENUM_IDX(n, activation_mode) == ACTIVATION_MODE_DISTANCE,     \
+                 "tiers need the distance activation mode");                               \
+    BUILD_ASSERT(TIER_LAYER_VALID(n, 1) && TIER_LAYER_VALID(n, 3) &&                       \
+                     TIER_LAYER_VALID(n, 5) && TIER_LAYER_VALID(n, 7),                     \
+                 "tier layers must be below 16");                                          \
+    BUILD_ASSERT(TIER_SORTED(n, 2, 0) && TIER_SORTED(n, 4, 2) && TIER_SORTED(n, 6, 4),     \
+                 "tiers must be sorted by threshold");                                     \
+    COND_CODE_0(DT_INST_PROP_LEN(n, tiers), (),                                            \
+                (static const int32_t threshold_temp_layer_tiers_##n[] =                   \
+                     DT_INST_PROP(n, tiers);))                                             \
+    static const struct threshold_temp_layer_layer_config                                  \
+        threshold_temp_layer_layer_configs_##n[] = {THRESHOLD_TEMP_LAYER_LAYER_CONFIGS(n)}; \
+    static struct threshold_temp_layer_layer_data                                          \
+        threshold_temp_layer_layers_##n[THRESHOLD_TEMP_LAYER_NUM_SLOTS(n)];                \
+    COND_CODE_0(DT_INST_PROP(n, predict_frames), (),                                       \
+                (static struct threshold_temp_layer_predict_data                           \
+                     threshold_temp_layer_predict_##n[THRESHOLD_TEMP_LAYER_NUM_SLOTS(n)];)) \
     static const struct threshold_temp_layer_config threshold_temp_layer_config_##n = {     \
-        .require_prior_idle_ms = DT_INST_PROP(n, require_prior_idle_ms),                   \
-        .activation_threshold = DT_INST_PROP(n, activation_threshold),                     \
-        .excluded_positions = excluded_positions_##n,                                       \
-        .excluded_positions_len = DT_INST_PROP_LEN(n, excluded_positions),                 \
+        .activation_mode = DT_INST_ENUM_IDX(n, activation_mode),                           \
+        .distance_metric = DT_INST_ENUM_IDX(n, distance_metric),                           \
+        .deactivate_policy = DT_INST_ENUM_IDX(n, deactivate_policy),                       \
+        .velocity_threshold = (int32_t)(((int64_t)DT_INST_PROP(n, velocity_threshold) << 16) / \
+                                        1000),                                             \
+        .velocity_smoothing = DT_INST_PROP(n, velocity_smoothing),                         \
+        .decay_window_ms = DT_INST_PROP(n, decay_window_ms),                               \
+        .decay_per_ms = DT_INST_PROP(n, decay_per_ms),                                     \
+        .rearm_window_ms = DT_INST_PROP(n, rearm_window_ms),                               \
+        .rearm_threshold = DT_INST_PROP(n, rearm_threshold),                               \
+        .predict_frames = DT_INST_PROP(n, predict_frames),                                 \
+        .predict_confirm_ms = DT_INST_PROP(n, predict_confirm_ms),                         \
+        .tiers = COND_CODE_0(DT_INST_PROP_LEN(n, tiers), (NULL),                           \
+                             (threshold_temp_layer_tiers_##n)),                            \
+        .num_tiers = DT_INST_PROP_LEN(n, tiers) / 2,                                       \
+        .cpi = DT_INST_PROP(n, cpi),                                                       \
+        .wheel_weight = DT_INST_PROP(n, wheel_weight),                                     \
+        .dead_zone_x = DT_INST_PROP(n, dead_zone_x),                                       \
+        .dead_zone_y = DT_INST_PROP(n, dead_zone_y),                                       \
+        .x_weight = DT_INST_PROP(n, x_weight),                                             \
+        .y_weight = DT_INST_PROP(n, y_weight),                                             \
+        .sign_filter = DT_INST_PROP(n, sign_filter),                                       \
+        .frame_accumulation = DT_INST_PROP(n, frame_accumulation),                         \
+        .excluded_positions = {LISTIFY(POSITION_BITMAP_WORDS, EXCLUDED_POSITIONS_WORD,     \
+                                       (, ), n)},                                          \
+        .layer_slots = THRESHOLD_TEMP_LAYER_LAYER_SLOTS(n),                                \
+        .num_slots = THRESHOLD_TEMP_LAYER_NUM_SLOTS(n),                                    \
+        .layer_configs = threshold_temp_layer_layer_configs_##n,                           \
+        .layers = threshold_temp_layer_layers_##n,                                         \
+        .predict = COND_CODE_0(DT_INST_PROP(n, predict_frames), (NULL),                    \
+                               (threshold_temp_layer_predict_##n)),                        \
     };                                                                                       \
     static struct threshold_temp_layer_data threshold_temp_layer_data_##n = {};             \
     DEVICE_DT_INST_DEFINE(n, threshold_temp_layer_init, NULL,                              \
@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2024 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/printk.h>
+
+#include "input_processor_threshold_temp_layer_trace.h"
+
+LOG_MODULE_DECLARE(zmk, CONFIG_ZMK_LOG_LEVEL);
+
+#define TRACE_BUFFER_SIZE CONFIG_ZMK_INPUT_PROCESSOR_THRESHOLD_TEMP_LAYER_TRACE_BUFFER_SIZE
+#define TRACE_BATCH_SIZE 32
+
+BUILD_ASSERT(IS_POWER_OF_TWO(TRACE_BUFFER_SIZE), "trace buffer size must be a power of two");
+
+// Single producer (input thread), single consumer (drain thread). head and tail only ever
+// increase, the slot index is taken modulo the buffer size.
+static struct threshold_temp_layer_trace_record trace_buffer[TRACE_BUFFER_SIZE];
+static atomic_t trace_head;
+static atomic_t trace_tail;
+static atomic_t trace_dropped;
+
+// Only touched by the producer
+static uint32_t trace_last_time;
+
+static int16_t clamp_i16(int value) { return (int16_t)CLAMP(value, INT16_MIN, INT16_MAX); }
+
+void threshold_temp_layer_trace_frame(int dx, int dy, uint8_t layer, uint8_t flags,
+                                      uint32_t now) {
+    atomic_val_t head = atomic_get(&trace_head);
+
+    if ((uint32_t)(head - atomic_get(&trace_tail)) >= TRACE_BUFFER_SIZE) {
+        atomic_inc(&trace_dropped);
+        return;
+    }
+
+    struct threshold_temp_layer_trace_record *record =
+        &trace_buffer[head & (TRACE_BUFFER_SIZE - 1)];
+
+    record->dx = clamp_i16(dx);
+    record->dy = clamp_i16(dy);
+    record->dt = MIN(now - trace_last_time, UINT16_MAX);
+    record->layer = layer;
+    record->flags = flags;
+    trace_last_time = now;
+
+    // Publish the record only after it is fully written
+    atomic_set(&trace_head, head + 1);
+}
+
+static void trace_drain_thread(void *p1, void *p2, void *p3) {
+    struct threshold_temp_layer_trace_record batch[TRACE_BATCH_SIZE];
+
+    printk("ttl-trace,dt_ms,dx,dy,layer,flags\n");
+
+    while (true) {
+        k_sleep(K_MSEC(CONFIG_ZMK_INPUT_PROCESSOR_THRESHOLD_TEMP_LAYER_TRACE_DRAIN_INTERVAL_MS));
+
+        atomic_val_t dropped = atomic_clear(&trace_dropped);
+        if (dropped > 0) {
+            LOG_WRN("Trace buffer full, dropped %d records", (int)dropped);
+        }
+
+        while (true) {
+            atomic_val_t tail = atomic_get(&trace_tail);
+            uint32_t count = MIN((uint32_t)(atomic_get(&trace_head) - tail), TRACE_BATCH_SIZE);
+
+            if (count == 0) {
+                break;
+            }
+
+            for (uint32_t i = 0; i < count; i++) {
+                batch[i] = trace_buffer[(tail + i) & (TRACE_BUFFER_SIZE - 1)];
+            }
+
+            // Hand the slots back to the producer before the slow console output
+            atomic_set(&trace_tail, tail + count);
+
+            for (uint32_t i = 0; i < count; i++) {
+                printk("ttl-trace,%u,%d,%d,%u,%u\n", batch[i].dt, batch[i].dx, batch[i].dy,
+                       batch[i].layer, batch[i].flags);
+            }
+        }
+    }
+}
+
+K_THREAD_DEFINE(threshold_temp_layer_trace,
+                CONFIG_ZMK_INPUT_PROCESSOR_THRESHOLD_TEMP_LAYER_TRACE_THREAD_STACK_SIZE,
+                trace_drain_thread, NULL, NULL, NULL, K_LOWEST_APPLICATION_THREAD_PRIO, 0, 0);
@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2024 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <zephyr/sys/util.h>
+
+// The layer was already active when the frame arrived
+#define TRACE_FLAG_ACTIVE BIT(0)
+// The frame activated the layer
+#define TRACE_FLAG_ACTIVATED BIT(1)
+// The frame was dropped by the require-prior-idle-ms gate
+#define TRACE_FLAG_IDLE_GATED BIT(2)
+// The frame was dropped by the dead zone or the sign filter
+#define TRACE_FLAG_FILTERED BIT(3)
+
+struct threshold_temp_layer_trace_record {
+    // Frame motion before the dead zone, sign filter and axis weights
+    int16_t dx;
+    int16_t dy;
+    // Milliseconds since the previous record, saturated at UINT16_MAX
+    uint16_t dt;
+    uint8_t layer;
+    uint8_t flags;
+};
+
+// Queue one frame record for the drain thread. Only call from the input processing thread,
+// the ring buffer has a single producer.
+void threshold_temp_layer_trace_frame(int dx, int dy, uint8_t layer, uint8_t flags,
+                                      uint32_t now);
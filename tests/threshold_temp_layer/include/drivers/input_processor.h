@@ -0,0 +1,28 @@
+/*
+ * Copyright (c) 2024 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+// Test stand-in for the ZMK input processor driver API
+
+#include <zephyr/device.h>
+#include <zephyr/input/input.h>
+
+#define ZMK_INPUT_PROC_CONTINUE 0
+#define ZMK_INPUT_PROC_STOP 1
+
+struct zmk_input_processor_state {
+    uint8_t input_device_index;
+    int16_t *remainder;
+};
+
+typedef int (*zmk_input_processor_handle_event_callback_t)(
+    const struct device *dev, struct input_event *event, uint32_t param1, uint32_t param2,
+    struct zmk_input_processor_state *state);
+
+__subsystem struct zmk_input_processor_driver_api {
+    zmk_input_processor_handle_event_callback_t handle_event;
+};
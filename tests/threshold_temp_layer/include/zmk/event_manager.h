@@ -0,0 +1,24 @@
+/*
+ * Copyright (c) 2024 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+// Test stand-in for the ZMK event manager. A listener is exposed as a function pointer the
+// test calls with its events, subscriptions are implied.
+
+struct zmk_event_type {
+    const char *name;
+};
+
+typedef struct zmk_event_t {
+    const struct zmk_event_type *event;
+} zmk_event_t;
+
+typedef int (*zmk_listener_callback_t)(const zmk_event_t *eh);
+
+#define ZMK_LISTENER(mod, cb) const zmk_listener_callback_t zmk_listener_##mod = cb
+
+#define ZMK_SUBSCRIPTION(mod, ev) extern const zmk_listener_callback_t zmk_listener_##mod
@@ -0,0 +1,35 @@
+/*
+ * Copyright (c) 2024 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <zmk/event_manager.h>
+
+struct zmk_position_state_changed {
+    uint8_t source;
+    uint32_t position;
+    bool state;
+    int64_t timestamp;
+};
+
+extern const struct zmk_event_type zmk_event_zmk_position_state_changed;
+
+struct zmk_position_state_changed_event {
+    zmk_event_t header;
+    struct zmk_position_state_changed data;
+};
+
+static inline struct zmk_position_state_changed *
+as_zmk_position_state_changed(const zmk_event_t *eh) {
+    if (eh->event != &zmk_event_zmk_position_state_changed) {
+        return NULL;
+    }
+
+    return &((struct zmk_position_state_changed_event *)eh)->data;
+}
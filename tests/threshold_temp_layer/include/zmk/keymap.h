@@ -0,0 +1,18 @@
+/*
+ * Copyright (c) 2024 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+// Test stand-in for the ZMK keymap, recording the layer calls of the processor
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef uint8_t zmk_keymap_layer_id_t;
+
+int zmk_keymap_layer_activate(zmk_keymap_layer_id_t layer);
+int zmk_keymap_layer_deactivate(zmk_keymap_layer_id_t layer);
+bool zmk_keymap_layer_active(zmk_keymap_layer_id_t layer);
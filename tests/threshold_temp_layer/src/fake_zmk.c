@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2024 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/util.h>
+
+#include <zmk/event_manager.h>
+#include <zmk/events/position_state_changed.h>
+#include <zmk/input_processor_threshold_temp_layer.h>
+#include <zmk/keymap.h>
+
+#include "fake_zmk.h"
+
+LOG_MODULE_REGISTER(zmk, CONFIG_ZMK_LOG_LEVEL);
+
+#define FAKE_KEYMAP_LAYERS 32
+
+extern const zmk_listener_callback_t zmk_listener_threshold_temp_layer;
+
+const struct zmk_event_type zmk_event_zmk_position_state_changed = {
+    .name = "zmk_position_state_changed",
+};
+
+static uint32_t layer_state;
+static int layer_activations[FAKE_KEYMAP_LAYERS];
+static int layer_deactivations[FAKE_KEYMAP_LAYERS];
+static uint32_t layer_deactivated_at[FAKE_KEYMAP_LAYERS];
+static int base_layer_fallbacks;
+
+int zmk_keymap_layer_activate(zmk_keymap_layer_id_t layer) {
+    layer_state |= BIT(layer);
+    layer_activations[layer]++;
+    return 0;
+}
+
+int zmk_keymap_layer_deactivate(zmk_keymap_layer_id_t layer) {
+    layer_state &= ~BIT(layer);
+    layer_deactivations[layer]++;
+    layer_deactivated_at[layer] = k_uptime_get_32();
+    if (layer_state == 0) {
+        base_layer_fallbacks++;
+    }
+    return 0;
+}
+
+bool zmk_keymap_layer_active(zmk_keymap_layer_id_t layer) { return layer_state & BIT(layer); }
+
+void fake_keymap_reset(void) {
+    layer_state = 0;
+    memset(layer_activations, 0, sizeof(layer_activations));
+    memset(layer_deactivations, 0, sizeof(layer_deactivations));
+    memset(layer_deactivated_at, 0, sizeof(layer_deactivated_at));
+    base_layer_fallbacks = 0;
+}
+
+bool fake_keymap_layer_on(uint8_t layer) {
+    if (IS_ENABLED(CONFIG_ZMK_INPUT_PROCESSOR_THRESHOLD_TEMP_LAYER_DEFERRED_LAYER_UPDATES)) {
+        // Let the layer update work queue catch up
+        k_sleep(K_MSEC(1));
+    }
+
+    return zmk_keymap_layer_active(layer);
+}
+
+int fake_keymap_activations(uint8_t layer) { return layer_activations[layer]; }
+
+int fake_keymap_deactivations(uint8_t layer) { return layer_deactivations[layer]; }
+
+uint32_t fake_keymap_deactivated_at(uint8_t layer) { return layer_deactivated_at[layer]; }
+
+int fake_keymap_base_layer_fallbacks(void) { return base_layer_fallbacks; }
+
+static void fill_report(struct input_event events[2], int16_t dx, int16_t dy) {
+    events[0] = (struct input_event){.type = INPUT_EV_REL, .code = INPUT_REL_X, .value = dx};
+    events[1] = (struct input_event){
+        .type = INPUT_EV_REL, .code = INPUT_REL_Y, .value = dy, .sync = true};
+}
+
+void ttl_move(const struct device *dev, int16_t dx, int16_t dy, uint8_t layer,
+              uint16_t timeout_ms) {
+    struct input_event events[2];
+
+    fill_report(events, dx, dy);
+    zmk_input_processor_threshold_temp_layer_handle_events(dev, events, ARRAY_SIZE(events), layer,
+                                                           timeout_ms, NULL);
+}
+
+void ttl_move_at(const struct device *dev, int16_t dx, int16_t dy, uint32_t timestamp,
+                 uint8_t layer, uint16_t timeout_ms) {
+    struct input_event events[2];
+
+    fill_report(events, dx, dy);
+    zmk_input_processor_threshold_temp_layer_handle_events_at(dev, events, ARRAY_SIZE(events),
+                                                              timestamp, layer, timeout_ms, NULL);
+}
+
+void ttl_activate(const struct device *dev, uint8_t layer) {
+    // The first report after a pause reads as slow motion in velocity mode
+    ttl_move(dev, 500, 0, layer, 0);
+    k_sleep(K_MSEC(1));
+    ttl_move(dev, 500, 0, layer, 0);
+}
+
+void ttl_scroll(const struct device *dev, int16_t value, uint8_t layer, uint16_t timeout_ms) {
+    struct input_event event = {
+        .type = INPUT_EV_REL, .code = INPUT_REL_WHEEL, .value = value, .sync = true};
+
+    zmk_input_processor_threshold_temp_layer_handle_events(dev, &event, 1, layer, timeout_ms,
+                                                           NULL);
+}
+
+static void raise_position(uint32_t position, bool pressed) {
+    struct zmk_position_state_changed_event ev = {
+        .header = {.event = &zmk_event_zmk_position_state_changed},
+        .data = {.position = position, .state = pressed, .timestamp = k_uptime_get()},
+    };
+
+    zmk_listener_threshold_temp_layer(&ev.header);
+}
+
+void ttl_tap(uint32_t position) {
+    raise_position(position, true);
+    raise_position(position, false);
+}
+
+void ttl_press(uint32_t position) { raise_position(position, true); }
+
+void ttl_release(uint32_t position) { raise_position(position, false); }
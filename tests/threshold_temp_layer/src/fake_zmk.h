@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2024 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <zephyr/device.h>
+
+// Forget the recorded layer state and call counts
+void fake_keymap_reset(void);
+
+// Current state of a layer once pending deferred layer updates have been applied
+bool fake_keymap_layer_on(uint8_t layer);
+
+int fake_keymap_activations(uint8_t layer);
+int fake_keymap_deactivations(uint8_t layer);
+
+// Uptime of the last deactivation of a layer
+uint32_t fake_keymap_deactivated_at(uint8_t layer);
+
+// Deactivations that left no layer other than the base layer active
+int fake_keymap_base_layer_fallbacks(void);
+
+// Feed one REL_X/REL_Y report, the second event carries the sync flag
+void ttl_move(const struct device *dev, int16_t dx, int16_t dy, uint8_t layer,
+              uint16_t timeout_ms);
+
+// Like ttl_move(), with the sample timestamp of the driver
+void ttl_move_at(const struct device *dev, int16_t dx, int16_t dy, uint32_t timestamp,
+                 uint8_t layer, uint16_t timeout_ms);
+
+// Two large reports 1 ms apart, enough to activate a layer in every activation mode
+void ttl_activate(const struct device *dev, uint8_t layer);
+
+// Feed one REL_WHEEL event with the sync flag
+void ttl_scroll(const struct device *dev, int16_t value, uint8_t layer, uint16_t timeout_ms);
+
+// Press and release a key position
+void ttl_tap(uint32_t position);
+
+void ttl_press(uint32_t position);
+void ttl_release(uint32_t position);
@@ -0,0 +1,290 @@
+/*
+ * Copyright (c) 2024 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <errno.h>
+#include <zephyr/kernel.h>
+#include <zephyr/ztest.h>
+
+#include <zmk/input_processor_threshold_temp_layer.h>
+
+#include "fake_zmk.h"
+
+// Layers of the feature nodes in app.overlay
+#define UNBOUND_LAYER 5
+#define VELOCITY_LAYER 9
+#define DECAY_LAYER 10
+#define REARM_LAYER 11
+#define WHEEL_LAYER 12
+#define FILTER_LAYER 13
+#define RELEASE_LAYER 14
+#define CPI_LAYER 15
+
+// Positions of the ttl_policy_unbound layer in the keymap of app.overlay
+#define BOUND_POSITION 0
+#define TRANS_POSITION 1
+#define NONE_POSITION 2
+
+// A key position that deactivates every node, it has no binding on any layer
+#define KEY_POSITION 3
+
+#define REPORT_MS 8
+#define TIMEOUT_MS 100
+
+// Longer than rearm-window-ms of ttl_rearm
+#define IDLE_MS 350
+
+static const struct device *const ttl_policy_unbound =
+    DEVICE_DT_GET(DT_NODELABEL(ttl_policy_unbound));
+static const struct device *const ttl_velocity = DEVICE_DT_GET(DT_NODELABEL(ttl_velocity));
+static const struct device *const ttl_decay = DEVICE_DT_GET(DT_NODELABEL(ttl_decay));
+static const struct device *const ttl_rearm = DEVICE_DT_GET(DT_NODELABEL(ttl_rearm));
+static const struct device *const ttl_wheel = DEVICE_DT_GET(DT_NODELABEL(ttl_wheel));
+static const struct device *const ttl_filter = DEVICE_DT_GET(DT_NODELABEL(ttl_filter));
+static const struct device *const ttl_policy_release =
+    DEVICE_DT_GET(DT_NODELABEL(ttl_policy_release));
+static const struct device *const ttl_cpi = DEVICE_DT_GET(DT_NODELABEL(ttl_cpi));
+
+static void features_before(void *fixture) {
+    // Undo the tuning a test applied, then start from cleared accumulators
+    zmk_input_processor_threshold_temp_layer_reset_tuning(ttl_wheel);
+    zmk_input_processor_threshold_temp_layer_set_cpi(ttl_cpi, 800);
+
+    k_sleep(K_MSEC(IDLE_MS));
+    ttl_activate(ttl_policy_unbound, UNBOUND_LAYER);
+    ttl_activate(ttl_velocity, VELOCITY_LAYER);
+    ttl_activate(ttl_decay, DECAY_LAYER);
+    ttl_activate(ttl_rearm, REARM_LAYER);
+    ttl_activate(ttl_wheel, WHEEL_LAYER);
+    ttl_activate(ttl_filter, FILTER_LAYER);
+    ttl_activate(ttl_policy_release, RELEASE_LAYER);
+    ttl_activate(ttl_cpi, CPI_LAYER);
+    ttl_tap(KEY_POSITION);
+    k_sleep(K_MSEC(IDLE_MS));
+    fake_keymap_reset();
+}
+
+ZTEST(threshold_temp_layer_features, test_velocity_flick_activates) {
+    // The first report after a pause is slow by definition
+    ttl_move(ttl_velocity, 40, 0, VELOCITY_LAYER, 0);
+    zassert_false(fake_keymap_layer_on(VELOCITY_LAYER));
+
+    // 5 counts per ms, the average moves half way there and passes 2000 px/s
+    k_sleep(K_MSEC(REPORT_MS));
+    ttl_move(ttl_velocity, 40, 0, VELOCITY_LAYER, 0);
+    zassert_true(fake_keymap_layer_on(VELOCITY_LAYER));
+}
+
+ZTEST(threshold_temp_layer_features, test_velocity_ignores_slow_drift) {
+    // 0.5 counts per ms, four times the activation threshold of distance mode in total
+    for (int i = 0; i < 100; i++) {
+        k_sleep(K_MSEC(REPORT_MS));
+        ttl_move(ttl_velocity, 4, 0, VELOCITY_LAYER, 0);
+    }
+
+    zassert_false(fake_keymap_layer_on(VELOCITY_LAYER));
+    zassert_equal(fake_keymap_activations(VELOCITY_LAYER), 0);
+}
+
+ZTEST(threshold_temp_layer_features, test_decay_leaks_idle_motion) {
+    ttl_move(ttl_decay, 60, 0, DECAY_LAYER, 0);
+
+    // 50 ms beyond the decay window leak 50 of the 60 counts
+    k_sleep(K_MSEC(100));
+    ttl_move(ttl_decay, 60, 0, DECAY_LAYER, 0);
+    zassert_false(fake_keymap_layer_on(DECAY_LAYER));
+
+    k_sleep(K_MSEC(REPORT_MS));
+    ttl_move(ttl_decay, 30, 0, DECAY_LAYER, 0);
+    zassert_true(fake_keymap_layer_on(DECAY_LAYER));
+}
+
+ZTEST(threshold_temp_layer_features, test_decay_window_keeps_motion) {
+    ttl_move(ttl_decay, 60, 0, DECAY_LAYER, 0);
+
+    k_sleep(K_MSEC(40));
+    ttl_move(ttl_decay, 60, 0, DECAY_LAYER, 0);
+    zassert_true(fake_keymap_layer_on(DECAY_LAYER));
+}
+
+ZTEST(threshold_temp_layer_features, test_rearm_after_timeout) {
+    ttl_move(ttl_rearm, 120, 0, REARM_LAYER, TIMEOUT_MS);
+    k_sleep(K_MSEC(TIMEOUT_MS + 50));
+    zassert_false(fake_keymap_layer_on(REARM_LAYER));
+
+    ttl_move(ttl_rearm, 25, 0, REARM_LAYER, TIMEOUT_MS);
+    zassert_true(fake_keymap_layer_on(REARM_LAYER));
+    zassert_equal(fake_keymap_activations(REARM_LAYER), 2);
+}
+
+ZTEST(threshold_temp_layer_features, test_rearm_window_expires) {
+    ttl_move(ttl_rearm, 120, 0, REARM_LAYER, TIMEOUT_MS);
+    k_sleep(K_MSEC(TIMEOUT_MS + IDLE_MS));
+
+    ttl_move(ttl_rearm, 25, 0, REARM_LAYER, TIMEOUT_MS);
+    zassert_false(fake_keymap_layer_on(REARM_LAYER));
+
+    // The motion past the window counts towards the full threshold
+    ttl_move(ttl_rearm, 75, 0, REARM_LAYER, TIMEOUT_MS);
+    zassert_true(fake_keymap_layer_on(REARM_LAYER));
+}
+
+ZTEST(threshold_temp_layer_features, test_no_rearm_after_key_press) {
+    ttl_move(ttl_rearm, 120, 0, REARM_LAYER, TIMEOUT_MS);
+    ttl_tap(KEY_POSITION);
+    zassert_false(fake_keymap_layer_on(REARM_LAYER));
+
+    ttl_move(ttl_rearm, 25, 0, REARM_LAYER, TIMEOUT_MS);
+    zassert_false(fake_keymap_layer_on(REARM_LAYER));
+}
+
+ZTEST(threshold_temp_layer_features, test_wheel_weight) {
+    ttl_scroll(ttl_wheel, 5, WHEEL_LAYER, 0);
+    zassert_false(fake_keymap_layer_on(WHEEL_LAYER));
+
+    // Steps count by their size in both directions
+    ttl_scroll(ttl_wheel, -5, WHEEL_LAYER, 0);
+    zassert_true(fake_keymap_layer_on(WHEEL_LAYER));
+}
+
+ZTEST(threshold_temp_layer_features, test_wheel_ignored_without_weight) {
+    for (int i = 0; i < 20; i++) {
+        ttl_scroll(ttl_decay, 10, DECAY_LAYER, 0);
+    }
+
+    zassert_false(fake_keymap_layer_on(DECAY_LAYER));
+}
+
+ZTEST(threshold_temp_layer_features, test_dead_zone_drops_jitter) {
+    for (int i = 0; i < 100; i++) {
+        ttl_move(ttl_filter, i % 2 ? 2 : -2, 2, FILTER_LAYER, 0);
+    }
+
+    zassert_false(fake_keymap_layer_on(FILTER_LAYER));
+}
+
+ZTEST(threshold_temp_layer_features, test_sign_filter_drops_direction_changes) {
+    // Only the first report counts, every later one flips the direction of X
+    for (int i = 0; i < 60; i++) {
+        ttl_move(ttl_filter, i % 2 ? -20 : 20, 0, FILTER_LAYER, 0);
+    }
+
+    zassert_false(fake_keymap_layer_on(FILTER_LAYER));
+
+    ttl_move(ttl_filter, -20, 0, FILTER_LAYER, 0);
+    ttl_move(ttl_filter, -20, 0, FILTER_LAYER, 0);
+    zassert_true(fake_keymap_layer_on(FILTER_LAYER));
+}
+
+ZTEST(threshold_temp_layer_features, test_axis_weight) {
+    // X counts twice, Y once
+    for (int i = 0; i < 16; i++) {
+        ttl_move(ttl_filter, 0, 6, FILTER_LAYER, 0);
+    }
+
+    zassert_false(fake_keymap_layer_on(FILTER_LAYER));
+
+    ttl_move(ttl_filter, 3, 0, FILTER_LAYER, 0);
+    zassert_true(fake_keymap_layer_on(FILTER_LAYER));
+}
+
+ZTEST(threshold_temp_layer_features, test_unbound_keys_policy) {
+    ttl_move(ttl_policy_unbound, 120, 0, UNBOUND_LAYER, 0);
+    zassert_true(fake_keymap_layer_on(UNBOUND_LAYER));
+
+    ttl_tap(BOUND_POSITION);
+    zassert_true(fake_keymap_layer_on(UNBOUND_LAYER));
+
+    ttl_tap(TRANS_POSITION);
+    zassert_false(fake_keymap_layer_on(UNBOUND_LAYER));
+
+    ttl_move(ttl_policy_unbound, 120, 0, UNBOUND_LAYER, 0);
+    zassert_true(fake_keymap_layer_on(UNBOUND_LAYER));
+    ttl_tap(NONE_POSITION);
+    zassert_false(fake_keymap_layer_on(UNBOUND_LAYER));
+
+    // Past the end of the layer's bindings
+    ttl_move(ttl_policy_unbound, 120, 0, UNBOUND_LAYER, 0);
+    zassert_true(fake_keymap_layer_on(UNBOUND_LAYER));
+    ttl_tap(KEY_POSITION);
+    zassert_false(fake_keymap_layer_on(UNBOUND_LAYER));
+    zassert_equal(fake_keymap_deactivations(UNBOUND_LAYER), 3);
+}
+
+ZTEST(threshold_temp_layer_features, test_release_policy) {
+    ttl_move(ttl_policy_release, 120, 0, RELEASE_LAYER, 0);
+
+    ttl_press(KEY_POSITION);
+    zassert_true(fake_keymap_layer_on(RELEASE_LAYER));
+
+    ttl_release(KEY_POSITION);
+    zassert_false(fake_keymap_layer_on(RELEASE_LAYER));
+}
+
+ZTEST(threshold_temp_layer_features, test_cpi_threshold) {
+    // 1000 um at 800 cpi round to 31 counts
+    ttl_move(ttl_cpi, 30, 0, CPI_LAYER, 0);
+    zassert_false(fake_keymap_layer_on(CPI_LAYER));
+
+    ttl_move(ttl_cpi, 1, 0, CPI_LAYER, 0);
+    zassert_true(fake_keymap_layer_on(CPI_LAYER));
+}
+
+ZTEST(threshold_temp_layer_features, test_set_cpi_rescales) {
+    zassert_ok(zmk_input_processor_threshold_temp_layer_set_cpi(ttl_cpi, 1600));
+
+    // 63 counts at 1600 cpi
+    ttl_move(ttl_cpi, 62, 0, CPI_LAYER, 0);
+    zassert_false(fake_keymap_layer_on(CPI_LAYER));
+
+    ttl_move(ttl_cpi, 1, 0, CPI_LAYER, 0);
+    zassert_true(fake_keymap_layer_on(CPI_LAYER));
+}
+
+ZTEST(threshold_temp_layer_features, test_set_cpi_errors) {
+    zassert_equal(zmk_input_processor_threshold_temp_layer_set_cpi(ttl_wheel, 800), -ENOTSUP);
+    zassert_equal(zmk_input_processor_threshold_temp_layer_set_cpi(ttl_cpi, 0), -EINVAL);
+}
+
+ZTEST(threshold_temp_layer_features, test_adjust_threshold) {
+    zassert_ok(zmk_input_processor_threshold_temp_layer_adjust(ttl_wheel, 50, 0));
+
+    ttl_move(ttl_wheel, 140, 0, WHEEL_LAYER, 0);
+    zassert_false(fake_keymap_layer_on(WHEEL_LAYER));
+
+    ttl_move(ttl_wheel, 10, 0, WHEEL_LAYER, 0);
+    zassert_true(fake_keymap_layer_on(WHEEL_LAYER));
+}
+
+ZTEST(threshold_temp_layer_features, test_adjust_clamps_at_zero) {
+    // A threshold of 0 activates on the first motion
+    zassert_ok(zmk_input_processor_threshold_temp_layer_adjust(ttl_wheel, -1000, -1000));
+
+    ttl_move(ttl_wheel, 1, 0, WHEEL_LAYER, 0);
+    zassert_true(fake_keymap_layer_on(WHEEL_LAYER));
+}
+
+ZTEST(threshold_temp_layer_features, test_adjust_idle_gate) {
+    zassert_ok(zmk_input_processor_threshold_temp_layer_adjust(ttl_wheel, 0, 100));
+
+    ttl_tap(KEY_POSITION);
+    ttl_move(ttl_wheel, 120, 0, WHEEL_LAYER, 0);
+    zassert_false(fake_keymap_layer_on(WHEEL_LAYER));
+
+    k_sleep(K_MSEC(120));
+    ttl_move(ttl_wheel, 120, 0, WHEEL_LAYER, 0);
+    zassert_true(fake_keymap_layer_on(WHEEL_LAYER));
+}
+
+ZTEST(threshold_temp_layer_features, test_reset_tuning) {
+    zassert_ok(zmk_input_processor_threshold_temp_layer_adjust(ttl_wheel, 50, 100));
+    zassert_ok(zmk_input_processor_threshold_temp_layer_reset_tuning(ttl_wheel));
+
+    ttl_tap(KEY_POSITION);
+    ttl_move(ttl_wheel, 100, 0, WHEEL_LAYER, 0);
+    zassert_true(fake_keymap_layer_on(WHEEL_LAYER));
+}
+
+ZTEST_SUITE(threshold_temp_layer_features, NULL, NULL, features_before, NULL, NULL);
@@ -0,0 +1,243 @@
+/*
+ * Copyright (c) 2024 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/ztest.h>
+
+#include <zmk/input_processor_threshold_temp_layer.h>
+
+#include "fake_zmk.h"
+
+// Layers of the processor nodes in app.overlay
+#define DEFAULT_LAYER 1
+#define TIERS_LAYER 2
+#define TIER_UPGRADE_LAYER 3
+#define PREDICT_LAYER 4
+#define SHARED_LAYER 6
+#define SHARED_OTHER_LAYER 7
+
+// A key position that deactivates, and the one listed in excluded-positions
+#define KEY_POSITION 3
+#define EXCLUDED_POSITION 5
+
+// Longer than require-prior-idle-ms of ttl_default
+#define IDLE_MS 250
+
+static const struct device *const ttl_default = DEVICE_DT_GET(DT_NODELABEL(ttl_default));
+static const struct device *const ttl_tiers = DEVICE_DT_GET(DT_NODELABEL(ttl_tiers));
+static const struct device *const ttl_predict = DEVICE_DT_GET(DT_NODELABEL(ttl_predict));
+static const struct device *const ttl_shared = DEVICE_DT_GET(DT_NODELABEL(ttl_shared));
+
+// Activate every slot and deactivate it with a key press, so each test starts from cleared
+// accumulators and an expired idle gate
+static void threshold_temp_layer_before(void *fixture) {
+    k_sleep(K_MSEC(IDLE_MS));
+    ttl_move(ttl_default, 500, 0, DEFAULT_LAYER, 0);
+    ttl_move(ttl_tiers, 500, 0, TIERS_LAYER, 0);
+    ttl_move(ttl_predict, 500, 0, PREDICT_LAYER, 0);
+    ttl_move(ttl_shared, 500, 0, SHARED_LAYER, 0);
+    ttl_move(ttl_shared, 500, 0, SHARED_OTHER_LAYER, 0);
+    ttl_tap(KEY_POSITION);
+    k_sleep(K_MSEC(IDLE_MS));
+    fake_keymap_reset();
+}
+
+ZTEST(threshold_temp_layer, test_activates_at_threshold) {
+    ttl_move(ttl_default, 60, 0, DEFAULT_LAYER, 0);
+    zassert_false(fake_keymap_layer_on(DEFAULT_LAYER));
+
+    ttl_move(ttl_default, 0, 60, DEFAULT_LAYER, 0);
+    zassert_true(fake_keymap_layer_on(DEFAULT_LAYER));
+
+    ttl_move(ttl_default, 60, 0, DEFAULT_LAYER, 0);
+    zassert_equal(fake_keymap_activations(DEFAULT_LAYER), 1);
+}
+
+ZTEST(threshold_temp_layer, test_timeout_deactivates) {
+    ttl_move(ttl_default, 120, 0, DEFAULT_LAYER, 300);
+    zassert_true(fake_keymap_layer_on(DEFAULT_LAYER));
+
+    k_sleep(K_MSEC(200));
+    zassert_true(fake_keymap_layer_on(DEFAULT_LAYER));
+
+    k_sleep(K_MSEC(200));
+    zassert_false(fake_keymap_layer_on(DEFAULT_LAYER));
+    zassert_equal(fake_keymap_deactivations(DEFAULT_LAYER), 1);
+    zassert_false(zmk_input_processor_threshold_temp_layer_timer_pending(ttl_default));
+}
+
+ZTEST(threshold_temp_layer, test_motion_extends_timeout) {
+    ttl_move(ttl_default, 120, 0, DEFAULT_LAYER, 300);
+
+    for (int i = 0; i < 5; i++) {
+        k_sleep(K_MSEC(150));
+        ttl_move(ttl_default, 10, 0, DEFAULT_LAYER, 300);
+    }
+
+    zassert_true(fake_keymap_layer_on(DEFAULT_LAYER));
+
+    k_sleep(K_MSEC(400));
+    zassert_false(fake_keymap_layer_on(DEFAULT_LAYER));
+    zassert_equal(fake_keymap_deactivations(DEFAULT_LAYER), 1);
+}
+
+// The slots of one node share a single timeout work item armed for the nearest deadline
+
+ZTEST(threshold_temp_layer, test_earlier_deadline_reschedules_the_timeout) {
+    ttl_move(ttl_shared, 120, 0, SHARED_LAYER, 400);
+    ttl_move(ttl_shared, 120, 0, SHARED_OTHER_LAYER, 100);
+
+    k_sleep(K_MSEC(150));
+    zassert_false(fake_keymap_layer_on(SHARED_OTHER_LAYER));
+    zassert_true(fake_keymap_layer_on(SHARED_LAYER));
+
+    k_sleep(K_MSEC(300));
+    zassert_false(fake_keymap_layer_on(SHARED_LAYER));
+}
+
+ZTEST(threshold_temp_layer, test_later_deadline_keeps_the_timeout) {
+    ttl_move(ttl_shared, 120, 0, SHARED_LAYER, 100);
+    ttl_move(ttl_shared, 120, 0, SHARED_OTHER_LAYER, 400);
+
+    k_sleep(K_MSEC(150));
+    zassert_false(fake_keymap_layer_on(SHARED_LAYER));
+    zassert_true(fake_keymap_layer_on(SHARED_OTHER_LAYER));
+
+    k_sleep(K_MSEC(300));
+    zassert_false(fake_keymap_layer_on(SHARED_OTHER_LAYER));
+    zassert_equal(fake_keymap_deactivations(SHARED_LAYER), 1);
+    zassert_equal(fake_keymap_deactivations(SHARED_OTHER_LAYER), 1);
+    zassert_false(zmk_input_processor_threshold_temp_layer_timer_pending(ttl_shared));
+}
+
+ZTEST(threshold_temp_layer, test_key_press_deactivates) {
+    ttl_move(ttl_default, 120, 0, DEFAULT_LAYER, 0);
+    zassert_true(fake_keymap_layer_on(DEFAULT_LAYER));
+
+    ttl_tap(EXCLUDED_POSITION);
+    zassert_true(fake_keymap_layer_on(DEFAULT_LAYER));
+
+    ttl_tap(KEY_POSITION);
+    zassert_false(fake_keymap_layer_on(DEFAULT_LAYER));
+    zassert_equal(fake_keymap_deactivations(DEFAULT_LAYER), 1);
+}
+
+ZTEST(threshold_temp_layer, test_key_press_cancels_the_timeout) {
+    ttl_move(ttl_shared, 120, 0, SHARED_LAYER, 300);
+    ttl_move(ttl_shared, 120, 0, SHARED_OTHER_LAYER, 500);
+    zassert_true(zmk_input_processor_threshold_temp_layer_timer_pending(ttl_shared));
+
+    ttl_tap(KEY_POSITION);
+    zassert_false(fake_keymap_layer_on(SHARED_LAYER));
+    zassert_false(fake_keymap_layer_on(SHARED_OTHER_LAYER));
+    zassert_false(zmk_input_processor_threshold_temp_layer_timer_pending(ttl_shared));
+}
+
+ZTEST(threshold_temp_layer, test_idle_gate_after_key_press) {
+    ttl_tap(KEY_POSITION);
+    k_sleep(K_MSEC(50));
+    ttl_move(ttl_default, 200, 0, DEFAULT_LAYER, 0);
+    zassert_false(fake_keymap_layer_on(DEFAULT_LAYER));
+
+    // Gated motion is not accumulated either, the next frame starts from zero
+    k_sleep(K_MSEC(IDLE_MS));
+    ttl_move(ttl_default, 60, 0, DEFAULT_LAYER, 0);
+    zassert_false(fake_keymap_layer_on(DEFAULT_LAYER));
+
+    ttl_move(ttl_default, 60, 0, DEFAULT_LAYER, 0);
+    zassert_true(fake_keymap_layer_on(DEFAULT_LAYER));
+}
+
+ZTEST(threshold_temp_layer, test_idle_gate_with_older_sample_timestamp) {
+    uint32_t sampled_at = zmk_input_processor_threshold_temp_layer_timestamp();
+
+    // The report was sampled before the key press but is processed after it
+    k_sleep(K_MSEC(20));
+    ttl_tap(KEY_POSITION);
+    ttl_move_at(ttl_default, 200, 0, sampled_at, DEFAULT_LAYER, 0);
+    zassert_false(fake_keymap_layer_on(DEFAULT_LAYER));
+}
+
+ZTEST(threshold_temp_layer, test_each_cycle_switches_the_layer_once) {
+    for (int i = 0; i < 3; i++) {
+        ttl_move(ttl_default, 120, 0, DEFAULT_LAYER, 0);
+        zassert_true(fake_keymap_layer_on(DEFAULT_LAYER));
+
+        ttl_tap(KEY_POSITION);
+        zassert_false(fake_keymap_layer_on(DEFAULT_LAYER));
+        k_sleep(K_MSEC(IDLE_MS));
+    }
+
+    zassert_equal(fake_keymap_activations(DEFAULT_LAYER), 3);
+    zassert_equal(fake_keymap_deactivations(DEFAULT_LAYER), 3);
+}
+
+ZTEST(threshold_temp_layer, test_euclidean_counts_path_length) {
+    // Back and forth motion has no net displacement but a path length of 120
+    ttl_move(ttl_tiers, 60, 0, TIERS_LAYER, 0);
+    ttl_move(ttl_tiers, -60, 0, TIERS_LAYER, 0);
+    zassert_true(fake_keymap_layer_on(TIERS_LAYER));
+}
+
+ZTEST(threshold_temp_layer, test_tier_upgrade_replaces_the_layer) {
+    ttl_move(ttl_tiers, 60, 80, TIERS_LAYER, 0);
+    zassert_true(fake_keymap_layer_on(TIERS_LAYER));
+    zassert_false(fake_keymap_layer_on(TIER_UPGRADE_LAYER));
+
+    ttl_move(ttl_tiers, 120, 160, TIERS_LAYER, 0);
+    zassert_true(fake_keymap_layer_on(TIER_UPGRADE_LAYER));
+    zassert_false(fake_keymap_layer_on(TIERS_LAYER));
+    // The new layer went on before the old one went off
+    zassert_equal(fake_keymap_base_layer_fallbacks(), 0);
+
+    ttl_tap(KEY_POSITION);
+    zassert_false(fake_keymap_layer_on(TIER_UPGRADE_LAYER));
+    zassert_equal(fake_keymap_deactivations(TIER_UPGRADE_LAYER), 1);
+    zassert_equal(fake_keymap_deactivations(TIERS_LAYER), 1);
+}
+
+ZTEST(threshold_temp_layer, test_prediction_reverted_when_motion_stops) {
+    ttl_move(ttl_predict, 40, 0, PREDICT_LAYER, 0);
+    zassert_false(fake_keymap_layer_on(PREDICT_LAYER));
+
+    // 80 accumulated plus the mean frame of 40 predicts the crossing
+    ttl_move(ttl_predict, 40, 0, PREDICT_LAYER, 0);
+    zassert_true(fake_keymap_layer_on(PREDICT_LAYER));
+
+    k_sleep(K_MSEC(80));
+    zassert_false(fake_keymap_layer_on(PREDICT_LAYER));
+    zassert_equal(fake_keymap_deactivations(PREDICT_LAYER), 1);
+    zassert_false(zmk_input_processor_threshold_temp_layer_timer_pending(ttl_predict));
+}
+
+ZTEST(threshold_temp_layer, test_prediction_confirmed_by_motion) {
+    ttl_move(ttl_predict, 40, 0, PREDICT_LAYER, 0);
+    ttl_move(ttl_predict, 40, 0, PREDICT_LAYER, 0);
+    ttl_move(ttl_predict, 40, 0, PREDICT_LAYER, 0);
+
+    k_sleep(K_MSEC(80));
+    zassert_true(fake_keymap_layer_on(PREDICT_LAYER));
+    zassert_equal(fake_keymap_activations(PREDICT_LAYER), 1);
+}
+
+ZTEST(threshold_temp_layer, test_clock_follows_uptime) {
+    uint32_t clock_start = zmk_input_processor_threshold_temp_layer_timestamp();
+    uint32_t uptime_start = k_uptime_get_32();
+
+    // Read at 1 kHz, a rounding error kept on every read would add up to several ms
+    for (int i = 0; i < 10000; i++) {
+        k_sleep(K_MSEC(1));
+        zmk_input_processor_threshold_temp_layer_timestamp();
+    }
+
+    int32_t clock_elapsed = zmk_input_processor_threshold_temp_layer_timestamp() - clock_start;
+    int32_t uptime_elapsed = k_uptime_get_32() - uptime_start;
+
+    zassert_within(clock_elapsed, uptime_elapsed, 1, "clock %d ms, uptime %d ms", clock_elapsed,
+                   uptime_elapsed);
+}
+
+ZTEST_SUITE(threshold_temp_layer, NULL, NULL, threshold_temp_layer_before, NULL, NULL);
@@ -0,0 +1,374 @@
+/*
+ * Copyright (c) 2024 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/ztest.h>
+
+#if defined(CONFIG_TIMING_FUNCTIONS)
+#include <zephyr/timing/timing.h>
+#endif
+
+#include <drivers/input_processor.h>
+#include <zmk/input_processor_threshold_temp_layer.h>
+#include <zmk/keymap.h>
+
+#include "fake_zmk.h"
+
+// Layer of the records in the trace and of all ttl_replay_* nodes
+#define REPLAY_LAYER 8
+#define REPLAY_TIMEOUT_MS 300
+#define REPLAY_MAX_RECORDS 256
+
+// Flags of the trace records, see src/input_processor_threshold_temp_layer_trace.h
+#define REPLAY_FLAG_ACTIVE BIT(0)
+#define REPLAY_FLAG_ACTIVATED BIT(1)
+
+// traces/reference.csv, a session in the trace capture format: resting jitter, flicks, slow
+// drift, a circle and back-and-forth jitter, with timeouts in between. Recorded with the
+// settings of ttl_replay_frame and a 300 ms timeout.
+static const unsigned char reference_csv[] = {
+#include "reference.csv.inc"
+};
+
+struct replay_record {
+    uint16_t dt;
+    int16_t dx;
+    int16_t dy;
+    uint8_t flags;
+};
+
+static struct replay_record records[REPLAY_MAX_RECORDS];
+static size_t record_count;
+
+// Where the time of one driver call goes. Classified by the layer state around the call,
+// which lags behind with deferred layer updates, so only trust the split without them.
+enum replay_path {
+    // Axis value buffered until the sync event of the report
+    REPLAY_PATH_BUFFER,
+    // Frame on an inactive layer that stays short of the threshold
+    REPLAY_PATH_DISTANCE,
+    // Frame that activated the layer
+    REPLAY_PATH_THRESHOLD,
+    // Frame on an active layer, which only records the motion for the lazy timeout
+    REPLAY_PATH_TIMEOUT,
+    REPLAY_PATH_COUNT,
+};
+
+static const char *const replay_path_names[REPLAY_PATH_COUNT] = {
+    [REPLAY_PATH_BUFFER] = "buffer",
+    [REPLAY_PATH_DISTANCE] = "distance",
+    [REPLAY_PATH_THRESHOLD] = "threshold",
+    [REPLAY_PATH_TIMEOUT] = "timeout",
+};
+
+struct replay_path_cycles {
+    uint32_t calls;
+    uint64_t total_cycles;
+    uint64_t max_cycles;
+};
+
+struct replay_node {
+    const char *name;
+    const struct device *dev;
+    bool frame_accumulation;
+    // Activations of the whole trace with the settings of the node
+    int activations;
+};
+
+static struct replay_path_cycles replay_paths[REPLAY_PATH_COUNT];
+
+// Read the next decimal field and the comma after it
+static bool parse_field(const unsigned char **pos, const unsigned char *end, int32_t *value) {
+    const unsigned char *p = *pos;
+    bool negative = p < end && *p == '-';
+    int32_t result = 0;
+
+    if (negative) {
+        p++;
+    }
+
+    if (p == end || *p < '0' || *p > '9') {
+        return false;
+    }
+
+    while (p < end && *p >= '0' && *p <= '9') {
+        result = result * 10 + (*p++ - '0');
+    }
+
+    if (p < end && *p == ',') {
+        p++;
+    }
+
+    *pos = p;
+    *value = negative ? -result : result;
+    return true;
+}
+
+// Collect the "ttl-trace,<dt>,<dx>,<dy>,<layer>,<flags>" lines of a console capture. The
+// header line, other console output and records of other layers are skipped.
+static size_t parse_trace(const unsigned char *csv, size_t len, struct replay_record *out,
+                          size_t max) {
+    static const char prefix[] = "ttl-trace,";
+    const unsigned char *end = csv + len;
+    size_t count = 0;
+
+    for (const unsigned char *line = csv; line < end && count < max;) {
+        const unsigned char *eol = memchr(line, '\n', end - line);
+        const unsigned char *p = line + sizeof(prefix) - 1;
+        int32_t fields[5];
+        size_t parsed = 0;
+
+        if (eol == NULL) {
+            eol = end;
+        }
+
+        if ((size_t)(eol - line) > sizeof(prefix) - 1 &&
+            memcmp(line, prefix, sizeof(prefix) - 1) == 0) {
+            while (parsed < ARRAY_SIZE(fields) && parse_field(&p, eol, &fields[parsed])) {
+                parsed++;
+            }
+        }
+
+        if (parsed == ARRAY_SIZE(fields) && fields[3] == REPLAY_LAYER) {
+            out[count++] = (struct replay_record){
+                .dt = fields[0], .dx = fields[1], .dy = fields[2], .flags = fields[4]};
+        }
+
+        line = eol + 1;
+    }
+
+    return count;
+}
+
+// Feed one event through the driver API, the way the input listener of ZMK calls processors
+static void replay_event(const struct replay_node *node, uint16_t code, int16_t value, bool sync) {
+    const struct zmk_input_processor_driver_api *api = node->dev->api;
+    struct input_event event = {.type = INPUT_EV_REL, .code = code, .value = value, .sync = sync};
+    bool was_on = zmk_keymap_layer_active(REPLAY_LAYER);
+    uint64_t cycles = 0;
+    enum replay_path path;
+
+#if defined(CONFIG_TIMING_FUNCTIONS)
+    timing_t start = timing_counter_get();
+#endif
+
+    api->handle_event(node->dev, &event, REPLAY_LAYER, REPLAY_TIMEOUT_MS, NULL);
+
+#if defined(CONFIG_TIMING_FUNCTIONS)
+    timing_t end = timing_counter_get();
+
+    cycles = timing_cycles_get(&start, &end);
+#endif
+
+    if (node->frame_accumulation && !sync) {
+        path = REPLAY_PATH_BUFFER;
+    } else if (was_on) {
+        path = REPLAY_PATH_TIMEOUT;
+    } else if (zmk_keymap_layer_active(REPLAY_LAYER)) {
+        path = REPLAY_PATH_THRESHOLD;
+    } else {
+        path = REPLAY_PATH_DISTANCE;
+    }
+
+    replay_paths[path].calls++;
+    replay_paths[path].total_cycles += cycles;
+    replay_paths[path].max_cycles = MAX(replay_paths[path].max_cycles, cycles);
+}
+
+static void check_timeout(uint32_t last_active, const char *when) {
+    zassert_within(fake_keymap_deactivated_at(REPLAY_LAYER) - last_active, REPLAY_TIMEOUT_MS, 2,
+                   "timeout %s deactivated %u ms after the last motion", when,
+                   fake_keymap_deactivated_at(REPLAY_LAYER) - last_active);
+}
+
+// Replay every record at its recorded time as a REL_X and a REL_Y event, the second one with
+// the sync flag. With check_flags, the layer state after each record must match its flags.
+static void replay(const struct replay_node *node, bool check_flags) {
+    uint32_t due = k_uptime_get_32();
+    uint32_t last_active = 0;
+    bool was_active = false;
+
+    for (size_t i = 0; i < record_count; i++) {
+        const struct replay_record *record = &records[i];
+
+        // The first record counts from the start of the capture, replay it right away
+        if (i > 0) {
+            int32_t wait;
+
+            due += record->dt;
+            wait = (int32_t)(due - k_uptime_get_32());
+            if (wait > 0) {
+                k_sleep(K_MSEC(wait));
+            }
+        }
+
+        uint32_t fed_at = k_uptime_get_32();
+
+        replay_event(node, INPUT_REL_X, record->dx, false);
+        replay_event(node, INPUT_REL_Y, record->dy, true);
+
+        if (check_flags) {
+            bool recorded = record->flags & (REPLAY_FLAG_ACTIVE | REPLAY_FLAG_ACTIVATED);
+
+            zassert_equal(fake_keymap_layer_on(REPLAY_LAYER), recorded,
+                          "layer state after record %zu", i);
+
+            if (was_active && !recorded) {
+                check_timeout(last_active, "in the trace");
+            }
+
+            if (recorded) {
+                last_active = fed_at;
+            }
+
+            was_active = recorded;
+        }
+    }
+
+    k_sleep(K_MSEC(REPLAY_TIMEOUT_MS + 50));
+    zassert_false(fake_keymap_layer_on(REPLAY_LAYER), "layer still active after the trace");
+
+    if (was_active) {
+        check_timeout(last_active, "at the end");
+    }
+}
+
+static void report(const struct replay_node *node) {
+    uint64_t max_cycles = 0;
+
+    TC_PRINT("%s: %d activations\n", node->name, fake_keymap_activations(REPLAY_LAYER));
+
+    for (int i = 0; i < REPLAY_PATH_COUNT; i++) {
+        const struct replay_path_cycles *path = &replay_paths[i];
+
+        if (path->calls == 0) {
+            continue;
+        }
+
+        max_cycles = MAX(max_cycles, path->max_cycles);
+
+#if defined(CONFIG_TIMING_FUNCTIONS)
+        TC_PRINT("  %-9s %4u events, %llu cycles on average, %llu at most (%llu ns)\n",
+                 replay_path_names[i], path->calls,
+                 (unsigned long long)(path->total_cycles / path->calls),
+                 (unsigned long long)path->max_cycles,
+                 (unsigned long long)timing_cycles_to_ns(path->max_cycles));
+#else
+        TC_PRINT("  %-9s %4u events\n", replay_path_names[i], path->calls);
+#endif
+    }
+
+#if CONFIG_ZMK_INPUT_PROCESSOR_THRESHOLD_TEMP_LAYER_CYCLE_BUDGET > 0
+    zassert_true(max_cycles <= CONFIG_ZMK_INPUT_PROCESSOR_THRESHOLD_TEMP_LAYER_CYCLE_BUDGET,
+                 "%llu cycles for one event, the budget is %d", (unsigned long long)max_cycles,
+                 CONFIG_ZMK_INPUT_PROCESSOR_THRESHOLD_TEMP_LAYER_CYCLE_BUDGET);
+#endif
+}
+
+static void replay_and_check(const struct replay_node *node, bool check_flags) {
+    replay(node, check_flags);
+    report(node);
+
+    zassert_equal(fake_keymap_activations(REPLAY_LAYER), node->activations);
+    zassert_equal(fake_keymap_deactivations(REPLAY_LAYER), node->activations);
+}
+
+// The trace was recorded with these settings, so it must replay to the recorded layer states
+static const struct replay_node replay_frame = {
+    .name = "frame-accumulation, octagon",
+    .dev = DEVICE_DT_GET(DT_NODELABEL(ttl_replay_frame)),
+    .frame_accumulation = true,
+    .activations = 4,
+};
+
+// Each axis event is a frame of its own, so the slow drift adds dx + dy instead of the
+// octagon distance of the report and crosses the threshold
+static const struct replay_node replay_axis = {
+    .name = "per-axis",
+    .dev = DEVICE_DT_GET(DT_NODELABEL(ttl_replay_axis)),
+    .activations = 5,
+};
+
+static const struct replay_node replay_alpha = {
+    .name = "alpha-max-beta-min",
+    .dev = DEVICE_DT_GET(DT_NODELABEL(ttl_replay_alpha)),
+    .frame_accumulation = true,
+    .activations = 4,
+};
+
+static const struct replay_node replay_euclidean = {
+    .name = "euclidean",
+    .dev = DEVICE_DT_GET(DT_NODELABEL(ttl_replay_euclidean)),
+    .frame_accumulation = true,
+    .activations = 4,
+};
+
+// Only the flicks and the circle are fast enough, drift and jitter never are
+static const struct replay_node replay_velocity = {
+    .name = "velocity",
+    .dev = DEVICE_DT_GET(DT_NODELABEL(ttl_replay_velocity)),
+    .frame_accumulation = true,
+    .activations = 3,
+};
+
+// The sign filter drops the back-and-forth jitter, which the other nodes count in full
+static const struct replay_node replay_filtered = {
+    .name = "dead zone and sign filter",
+    .dev = DEVICE_DT_GET(DT_NODELABEL(ttl_replay_filtered)),
+    .frame_accumulation = true,
+    .activations = 3,
+};
+
+static const struct replay_node *const replay_nodes[] = {
+    &replay_frame,     &replay_axis,     &replay_alpha,
+    &replay_euclidean, &replay_velocity, &replay_filtered,
+};
+
+static void *replay_setup(void) {
+#if defined(CONFIG_TIMING_FUNCTIONS)
+    timing_init();
+    timing_start();
+#endif
+    record_count = parse_trace(reference_csv, sizeof(reference_csv), records,
+                               ARRAY_SIZE(records));
+    return NULL;
+}
+
+static void replay_before(void *fixture) {
+    // Start from cleared accumulators, whatever ran before
+    k_sleep(K_MSEC(REPLAY_TIMEOUT_MS));
+    for (size_t i = 0; i < ARRAY_SIZE(replay_nodes); i++) {
+        ttl_activate(replay_nodes[i]->dev, REPLAY_LAYER);
+        ttl_tap(3);
+    }
+    k_sleep(K_MSEC(REPLAY_TIMEOUT_MS));
+    fake_keymap_reset();
+    memset(replay_paths, 0, sizeof(replay_paths));
+}
+
+ZTEST(threshold_temp_layer_replay, test_trace_parsed) {
+    zassert_true(record_count > 100, "%zu records in the reference trace", record_count);
+    zassert_true(record_count < ARRAY_SIZE(records), "reference trace truncated");
+}
+
+ZTEST(threshold_temp_layer_replay, test_frame_accumulation) {
+    replay_and_check(&replay_frame, true);
+}
+
+ZTEST(threshold_temp_layer_replay, test_per_axis) { replay_and_check(&replay_axis, false); }
+
+ZTEST(threshold_temp_layer_replay, test_alpha_max_beta_min) {
+    replay_and_check(&replay_alpha, false);
+}
+
+ZTEST(threshold_temp_layer_replay, test_euclidean) { replay_and_check(&replay_euclidean, false); }
+
+ZTEST(threshold_temp_layer_replay, test_velocity) { replay_and_check(&replay_velocity, false); }
+
+ZTEST(threshold_temp_layer_replay, test_filters) { replay_and_check(&replay_filtered, false); }
+
+ZTEST_SUITE(threshold_temp_layer_replay, NULL, replay_setup, replay_before, NULL, NULL);